@@ -1,9 +1,19 @@
 #include <stdio.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
 #include <mcp23s17.h>
 #include "pifacecad.h"
+#include "pifacecad_internal.h"
 
 
 // PiFace Control and Display is always at /dev/spidev0.1, hw_addr = 0
@@ -13,15 +23,174 @@ static int mcp23s17_fd = 0; // MCP23S17 SPI file descriptor
 static const int SWITCH_PORT = GPIOA;
 static const int LCD_PORT = GPIOB;
 
-// current lcd state
-// static int curcol = 0, currow = 0;
-static uint8_t cur_address = 0;
-static uint8_t cur_entry_mode = 0;
-static uint8_t cur_function_set = 0;
-static uint8_t cur_display_control = 0;
+#define LCD_STATE_MAGIC 0x50434144 // "PCAD"
+#define MAX_BURST_REGS 8
+#define LCD_ROW_WIDTH (LCD_RAM_WIDTH / 2)
+#define LCD_BUSY_FLAG 0x80
+#define LCD_CHECK_TRIES 4
+
+// LCD bytes sent per SPI message, and the SPI bytes each one takes: the
+// opcode, GPIOB and six GPIOB values (hi, hi|E, hi, lo, lo|E, lo) with an
+// OLATA byte between each, since with SEQOP off the address pointer
+// toggles between GPIOB and GPIOA
+#define LCD_BATCH_LEN 64
+#define LCD_BATCH_SEG_LEN (2 + 6 * 2 - 1)
+#define LCD_SEQ_LEN (LCD_BATCH_SEG_LEN - 2) // less the opcode and GPIOB
+
+// The GPIOB/OLATA bytes which send b, worked out by the compiler for every
+// backlight, RS and byte value so that queuing a byte is a copy.
+#define LCD_SEQ_HI(bl, rs, b) \
+    (((bl) << PIN_BACKLIGHT) | ((rs) << PIN_RS) | (((b) >> 4) & 0xf))
+#define LCD_SEQ_LO(bl, rs, b) \
+    (((bl) << PIN_BACKLIGHT) | ((rs) << PIN_RS) | ((b) & 0xf))
+#define LCD_SEQ(bl, rs, b) { \
+    LCD_SEQ_HI(bl, rs, b), 0xff, \
+    LCD_SEQ_HI(bl, rs, b) | (1 << PIN_ENABLE), 0xff, \
+    LCD_SEQ_HI(bl, rs, b), 0xff, \
+    LCD_SEQ_LO(bl, rs, b), 0xff, \
+    LCD_SEQ_LO(bl, rs, b) | (1 << PIN_ENABLE), 0xff, \
+    LCD_SEQ_LO(bl, rs, b) }
+#define LCD_SEQ4(bl, rs, b) \
+    LCD_SEQ(bl, rs, (b)), LCD_SEQ(bl, rs, (b) + 1), \
+    LCD_SEQ(bl, rs, (b) + 2), LCD_SEQ(bl, rs, (b) + 3)
+#define LCD_SEQ16(bl, rs, b) \
+    LCD_SEQ4(bl, rs, (b)), LCD_SEQ4(bl, rs, (b) + 4), \
+    LCD_SEQ4(bl, rs, (b) + 8), LCD_SEQ4(bl, rs, (b) + 12)
+#define LCD_SEQ64(bl, rs, b) \
+    LCD_SEQ16(bl, rs, (b)), LCD_SEQ16(bl, rs, (b) + 16), \
+    LCD_SEQ16(bl, rs, (b) + 32), LCD_SEQ16(bl, rs, (b) + 48)
+#define LCD_SEQ256(bl, rs) { \
+    LCD_SEQ64(bl, rs, 0), LCD_SEQ64(bl, rs, 64), \
+    LCD_SEQ64(bl, rs, 128), LCD_SEQ64(bl, rs, 192) }
+
+static const uint8_t lcd_seqs[2][2][256][LCD_SEQ_LEN] = { // [bl][rs][b]
+    {LCD_SEQ256(0, 0), LCD_SEQ256(0, 1)},
+    {LCD_SEQ256(1, 0), LCD_SEQ256(1, 1)},
+};
+
+// what lcd_read_begin changed, for lcd_read_end to put back
+struct lcd_read {
+    uint8_t ac;
+    uint8_t ac_cgram;
+    uint8_t entry_mode_changed;
+};
+
+// LCD bytes waiting to go out in one SPI message
+struct lcd_batch {
+    int num;
+    uint8_t rs[LCD_BATCH_LEN];
+    uint8_t bytes[LCD_BATCH_LEN];
+    uint8_t tx[LCD_BATCH_LEN][LCD_BATCH_SEG_LEN];
+    struct spi_ioc_transfer transfers[LCD_BATCH_LEN];
+};
+
+// A call to one of the public functions, to be run on the real-time
+// worker. func is cast back to its real type, which kind says.
+enum rt_kind {
+    RT_VOID, // void f(void)
+    RT_VOID_U8, // void f(uint8_t)
+    RT_VOID_U8_PTR, // void f(uint8_t, uint8_t *)
+    RT_U8, // uint8_t f(void)
+    RT_U8_U8_U8, // uint8_t f(uint8_t, uint8_t)
+    RT_U8_STR_SIZE, // uint8_t f(const char *, size_t)
+    RT_U8_SEGS_INT, // uint8_t f(const struct pifacecad_lcd_segment *, int)
+    RT_INT, // int f(void)
+    RT_INT_PTR, // int f(uint8_t *)
+};
+
+struct rt_entry {
+    enum rt_kind kind;
+    void (*func)(void);
+    uintptr_t arg0, arg1;
+    intptr_t ret;
+    int error; // errno, which belongs to the worker's thread
+};
+
+// hands a public function call over to the real-time worker, if it is
+// running, and returns what it returned
+#define RT_ROUTE(kind, func, arg0, arg1) \
+    do { \
+        struct rt_entry rt_entry_ = { \
+            kind, (void (*)(void)) func, \
+            (uintptr_t) (arg0), (uintptr_t) (arg1), 0, 0 \
+        }; \
+        if (rt_route(&rt_entry_)) { \
+            return; \
+        } \
+    } while (0)
+#define RT_ROUTE_RET(type, kind, func, arg0, arg1) \
+    do { \
+        struct rt_entry rt_entry_ = { \
+            kind, (void (*)(void)) func, \
+            (uintptr_t) (arg0), (uintptr_t) (arg1), 0, 0 \
+        }; \
+        if (rt_route(&rt_entry_)) { \
+            return (type) rt_entry_.ret; \
+        } \
+    } while (0)
+
+// current lcd state, either private to this process or shared between
+// processes through a POSIX shared memory object
+struct lcd_state {
+    uint32_t magic;
+    pthread_mutex_t lock; // recursive, robust when shared
+    uint8_t cur_address;
+    uint8_t cur_entry_mode;
+    uint8_t cur_function_set;
+    uint8_t cur_display_control;
+    uint8_t cur_port; // last value written to GPIOB
+    uint8_t port_valid; // cur_port matches the chip
+    uint8_t synced; // controller has been initialised with this state
+    // what the controller holds, as far as we know
+    uint8_t ac; // address counter
+    uint8_t ac_cgram; // address counter points into CGRAM
+    uint8_t display_shift; // positions the display has moved left (0-39)
+    uint8_t cgram_stored; // bit per custom bitmap location we have stored
+    uint8_t ddram[LCD_RAM_WIDTH]; // col + row * 40
+    uint8_t cgram[8 * 8];
+    // CLOCK_MONOTONIC time the controller finishes its last instruction,
+    // the next enable pulse waits for it instead of sleeping after each one
+    uint64_t busy_until_ns;
+};
+
+static struct lcd_state local_state;
+static struct lcd_state * lcd = &local_state;
+static pthread_once_t local_state_once = PTHREAD_ONCE_INIT;
+static __thread int lock_depth = 0; // lcd_lock nesting in this thread
+static int lcd_changed = 0; // GPIOB written since the last commit
+static int interrupts_enabled = 0;
 
 
 // static function definitions
+static int rt_route(struct rt_entry * entry);
+static void rt_entry_run(void * arg);
+static void local_state_init(void);
+static void lcd_lock(void);
+static void lcd_unlock(void);
+static uint8_t lcd_port_get(void);
+static void lcd_port_put(uint8_t value);
+static void lcd_port_write_bit(uint8_t state, uint8_t bit_num);
+static void lcd_set_display_control(uint8_t display_control);
+static void lcd_set_entry_mode(uint8_t entry_mode);
+static void lcd_batch_init(struct lcd_batch * batch);
+static void lcd_batch_add(struct lcd_batch * batch, uint8_t rs, uint8_t b);
+static void lcd_batch_address(struct lcd_batch * batch, uint8_t address);
+static void lcd_batch_text(struct lcd_batch * batch,
+                           const char * message,
+                           size_t len);
+static void lcd_batch_flush(struct lcd_batch * batch);
+static long lcd_exec_ns(uint8_t rs, uint8_t b);
+static void lcd_track_command(uint8_t command);
+static void lcd_track_data(uint8_t data);
+static uint8_t lcd_ac_step(uint8_t ac, int increment);
+static int ddram_index(uint8_t address);
+static uint8_t lcd_read_byte(uint8_t rs);
+static void lcd_read_bytes(uint8_t rs, uint8_t * buf, int len);
+static int lcd_read_status(void);
+static int lcd_read_begin(struct lcd_read * read);
+static void lcd_read_end(const struct lcd_read * read);
+static void lcd_busy_for(long nanoseconds);
+static void lcd_wait_ready(void);
 static void sleep_ns(long nanoseconds);
 static int max(int a, int b);
 static int min(int a, int b);
@@ -29,6 +198,11 @@ static int min(int a, int b);
 
 int pifacecad_open_noinit(void)
 {
+    if (cad_sim_active()) {
+        // no SPI, but keep a real fd so that callers can treat it as one
+        return mcp23s17_fd = open("/dev/null", O_RDWR);
+    }
+
     // All PiFace Digital are connected to the same SPI bus, only need 1 fd.
     if ((mcp23s17_fd = mcp23s17_open(bus, chip_select)) < 0) {
         return -1;
@@ -38,7 +212,10 @@ int pifacecad_open_noinit(void)
 
 int pifacecad_open(void)
 {
-    pifacecad_open_noinit();
+    RT_ROUTE_RET(int, RT_INT, pifacecad_open, 0, 0);
+    if (pifacecad_open_noinit() < 0) {
+        return -1;
+    }
 
     // Set IO config
     const uint8_t ioconfig = BANK_OFF | \
@@ -48,17 +225,17 @@ int pifacecad_open(void)
                              HAEN_ON | \
                              ODR_OFF | \
                              INTPOL_LOW;
-    mcp23s17_write_reg(ioconfig, IOCON, hw_addr, mcp23s17_fd);
+    cad_write_reg(ioconfig, IOCON, hw_addr);
 
     // Set GPIO Port A as inputs (switches)
-    mcp23s17_write_reg(0xff, IODIRA, hw_addr, mcp23s17_fd);
-    mcp23s17_write_reg(0xff, GPPUA, hw_addr, mcp23s17_fd);
+    cad_write_reg(0xff, IODIRA, hw_addr);
+    cad_write_reg(0xff, GPPUA, hw_addr);
 
     // Set GPIO Port B as outputs (connected to HD44780)
-    mcp23s17_write_reg(0x00, IODIRB, hw_addr, mcp23s17_fd);
+    cad_write_reg(0x00, IODIRB, hw_addr);
 
     // enable interrupts
-    mcp23s17_write_reg(0xFF, GPINTENA, hw_addr, mcp23s17_fd);
+    cad_write_reg(0xFF, GPINTENA, hw_addr);
 
     pifacecad_lcd_init();
 
@@ -67,97 +244,304 @@ int pifacecad_open(void)
 
 void pifacecad_close(void)
 {
+    pifacecad_backlight_pwm_stop();
+    pifacecad_group_close();
+
+    // leave the controller idle for whoever opens it next
+    lcd_lock();
+    lcd_wait_ready();
+    lcd_unlock();
+
     // disable interrupts if enabled
-    const uint8_t intenb = mcp23s17_read_reg(GPINTENA, hw_addr, mcp23s17_fd);
+    const uint8_t intenb = cad_read_reg(GPINTENA, hw_addr);
     if (intenb) {
-        mcp23s17_write_reg(0, GPINTENA, hw_addr, mcp23s17_fd);
-        // now do some other interrupt stuff...
-        // TODO
+        cad_write_reg(0, GPINTENA, hw_addr);
+    }
+    if (interrupts_enabled) {
+        pifacecad_disable_interrupts();
     }
     close(mcp23s17_fd);
 }
 
 void pifacecad_lcd_init(void)
 {
+    RT_ROUTE(RT_VOID, pifacecad_lcd_init, 0, 0);
+    lcd_lock();
+    lcd->synced = 0;
+    lcd->cgram_stored = 0;
+    lcd->cur_function_set = 0;
+    lcd->cur_display_control = 0;
+    lcd->cur_entry_mode = 0;
+
     // setup sequence
-    sleep_ns(DELAY_SETUP_0_NS);
-    mcp23s17_write_reg(0x3, LCD_PORT, hw_addr, mcp23s17_fd);
+    lcd_busy_for(DELAY_SETUP_0_NS);
+    lcd_port_put(0x3);
     pifacecad_lcd_pulse_enable();
 
-    sleep_ns(DELAY_SETUP_1_NS);
-    mcp23s17_write_reg(0x3, LCD_PORT, hw_addr, mcp23s17_fd);
+    lcd_busy_for(DELAY_SETUP_1_NS);
+    lcd_port_put(0x3);
     pifacecad_lcd_pulse_enable();
 
-    sleep_ns(DELAY_SETUP_2_NS);
-    mcp23s17_write_reg(0x3, LCD_PORT, hw_addr, mcp23s17_fd);
+    lcd_busy_for(DELAY_SETUP_2_NS);
+    lcd_port_put(0x3);
     pifacecad_lcd_pulse_enable();
 
-    mcp23s17_write_reg(0x2, LCD_PORT, hw_addr, mcp23s17_fd);
+    lcd_port_put(0x2);
     pifacecad_lcd_pulse_enable();
 
-    cur_function_set |= LCD_4BITMODE | LCD_2LINE | LCD_5X8DOTS;
-    pifacecad_lcd_send_command(LCD_FUNCTIONSET | cur_function_set);
+    lcd->cur_function_set |= LCD_4BITMODE | LCD_2LINE | LCD_5X8DOTS;
+    pifacecad_lcd_send_command(LCD_FUNCTIONSET | lcd->cur_function_set);
 
-    cur_display_control |= LCD_DISPLAYOFF | LCD_CURSOROFF | LCD_BLINKOFF;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    lcd->cur_display_control |= LCD_DISPLAYOFF | LCD_CURSOROFF | LCD_BLINKOFF;
+    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | lcd->cur_display_control);
 
     pifacecad_lcd_clear();
 
-    cur_entry_mode |= LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT;
-    pifacecad_lcd_send_command(LCD_ENTRYMODESET | cur_entry_mode);
+    lcd->cur_entry_mode |= LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT;
+    pifacecad_lcd_send_command(LCD_ENTRYMODESET | lcd->cur_entry_mode);
 
-    cur_display_control |= LCD_DISPLAYON | LCD_CURSORON | LCD_BLINKON;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    lcd->cur_display_control |= LCD_DISPLAYON | LCD_CURSORON | LCD_BLINKON;
+    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | lcd->cur_display_control);
+
+    lcd->synced = 1;
+    lcd_unlock();
+}
+
+int pifacecad_shared_state_open(const char * name)
+{
+    if (name == NULL) {
+        name = PIFACECAD_SHM_NAME;
+    }
+
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fd < 0 && errno == EEXIST) {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (created && ftruncate(fd, sizeof(struct lcd_state)) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    // wait for the creator to size the object
+    struct stat st;
+    int tries;
+    for (tries = 0; tries < 100; tries++) {
+        if (fstat(fd, &st) == 0 && \
+                (size_t) st.st_size >= sizeof(struct lcd_state)) {
+            break;
+        }
+        sleep_ns(1000000L);
+    }
+    if (tries == 100) {
+        close(fd);
+        return -1;
+    }
+
+    struct lcd_state * state = mmap(NULL,
+                                    sizeof(struct lcd_state),
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_SHARED,
+                                    fd,
+                                    0);
+    close(fd);
+    if (state == MAP_FAILED) {
+        return -1;
+    }
+
+    if (created) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&state->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        // start from what this process knows about the display, so that
+        // neither it nor the processes which attach later have to resync
+        pthread_mutex_lock(&state->lock);
+        lcd_lock();
+        const size_t start = offsetof(struct lcd_state, cur_address);
+        memcpy((uint8_t *) state + start,
+               (const uint8_t *) lcd + start,
+               sizeof(struct lcd_state) - start);
+        lcd_unlock();
+        __atomic_store_n(&state->magic, LCD_STATE_MAGIC, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&state->lock);
+    } else {
+        // wait for the creator to initialise the lock
+        for (tries = 0; tries < 100; tries++) {
+            if (__atomic_load_n(&state->magic, __ATOMIC_ACQUIRE) == \
+                    LCD_STATE_MAGIC) {
+                break;
+            }
+            sleep_ns(1000000L);
+        }
+        if (tries == 100) {
+            munmap(state, sizeof(struct lcd_state));
+            return -1;
+        }
+    }
+
+    lcd = state;
+    return 0;
+}
+
+void pifacecad_shared_state_close(void)
+{
+    if (lcd != &local_state) {
+        // carry on privately from where the shared state left off
+        lcd_lock();
+        struct lcd_state * state = lcd;
+        const size_t start = offsetof(struct lcd_state, cur_address);
+        memcpy((uint8_t *) &local_state + start,
+               (uint8_t *) state + start,
+               sizeof(struct lcd_state) - start);
+        lcd_unlock();
+        lcd = &local_state;
+        munmap(state, sizeof(struct lcd_state));
+    }
 }
 
 
 uint8_t pifacecad_read_switches(void)
 {
-    return mcp23s17_read_reg(SWITCH_PORT, hw_addr, mcp23s17_fd);
+    RT_ROUTE_RET(uint8_t, RT_U8, pifacecad_read_switches, 0, 0);
+    if (cad_group_active()) {
+        // every board would answer a broadcast read
+        return pifacecad_group_read_switches(0);
+    }
+    const uint8_t switches = cad_read_reg(SWITCH_PORT, hw_addr);
+    cad_latency_switches(switches, cad_now_ns());
+    return switches;
 }
 
 uint8_t pifacecad_read_switch(uint8_t switch_num)
 {
-    return (mcp23s17_read_reg(SWITCH_PORT,
-                              hw_addr,
-                              mcp23s17_fd) >> switch_num) & 1;
+    return (pifacecad_read_switches() >> switch_num) & 1;
+}
+
+int pifacecad_enable_interrupts(void)
+{
+    RT_ROUTE_RET(int, RT_INT, pifacecad_enable_interrupts, 0, 0);
+    if (cad_group_active()) {
+        errno = ENOTSUP; // one interrupt line shared by every board
+        return -1;
+    }
+    cad_write_reg(0xFF, GPINTENA, hw_addr); // any switch changing
+    if (!cad_sim_active() && mcp23s17_enable_interrupts() < 0) {
+        return -1;
+    }
+    interrupts_enabled = 1;
+    return 0;
+}
+
+int pifacecad_disable_interrupts(void)
+{
+    RT_ROUTE_RET(int, RT_INT, pifacecad_disable_interrupts, 0, 0);
+    interrupts_enabled = 0;
+    return cad_sim_active() ? 0 : mcp23s17_disable_interrupts();
+}
+
+int pifacecad_wait_for_switches(uint8_t * switches, int timeout_ms)
+{
+    // A change since the port was last read is still captured, and
+    // holds the interrupt line so no new edge would wake us: report it
+    // rather than throw it away (a press and release in between would
+    // be lost).
+    int ret = cad_read_reg(INTFA, hw_addr) != 0;
+    if (!ret) {
+        ret = cad_sim_active() ? \
+            cad_sim_wait_for_interrupt(hw_addr, timeout_ms) : \
+            mcp23s17_wait_for_interrupt(timeout_ms);
+    }
+    if (ret > 0) {
+        // the port as it was when it changed, reading it clears the interrupt
+        *switches = cad_read_reg(INTCAPA, hw_addr);
+        cad_latency_switches(*switches, cad_now_ns());
+    }
+    return ret;
 }
 
 
 uint8_t pifacecad_lcd_write(const char * message)
 {
-    pifacecad_lcd_send_command(LCD_SETDDRAMADDR | cur_address);
+    return pifacecad_lcd_write_n(message, strlen(message));
+}
+
+uint8_t pifacecad_lcd_write_n(const char * message, size_t len)
+{
+    RT_ROUTE_RET(uint8_t, RT_U8_STR_SIZE,
+                 pifacecad_lcd_write_n, message, len);
+    struct lcd_batch batch;
+    lcd_lock();
+    lcd_batch_init(&batch);
+    lcd_batch_address(&batch, lcd->cur_address);
+    lcd_batch_text(&batch, message, len);
+    lcd_batch_flush(&batch);
+    const uint8_t address = lcd->cur_address;
+    lcd_unlock();
+    return address;
+}
 
-    // for each character in the message
-    while (*message) {
-        if (*message == '\n') {
-            pifacecad_lcd_set_cursor(0, 1);
-        } else {
-            pifacecad_lcd_send_data(*message);
-            cur_address++;
+uint8_t pifacecad_lcd_writev(const struct pifacecad_lcd_segment * segments,
+                             int num)
+{
+    RT_ROUTE_RET(uint8_t, RT_U8_SEGS_INT,
+                 pifacecad_lcd_writev, segments, num);
+    struct lcd_batch batch;
+    lcd_lock();
+    lcd_batch_init(&batch);
+    int i;
+    for (i = 0; i < num; i++) {
+        if (segments[i].col != PIFACECAD_LCD_HERE) {
+            const uint8_t col = min(segments[i].col, LCD_ROW_WIDTH - 1);
+            const uint8_t row = min(segments[i].row, LCD_MAX_LINES - 1);
+            lcd->cur_address = colrow2address(col, row);
         }
-        message++;
+        lcd_batch_address(&batch, lcd->cur_address);
+        lcd_batch_text(&batch, segments[i].buf, segments[i].len);
     }
-    return cur_address;
+    lcd_batch_flush(&batch);
+    const uint8_t address = lcd->cur_address;
+    lcd_unlock();
+    return address;
 }
 
 uint8_t pifacecad_lcd_set_cursor(uint8_t col, uint8_t row)
 {
+    RT_ROUTE_RET(uint8_t, RT_U8_U8_U8, pifacecad_lcd_set_cursor, col, row);
     col = max(0, min(col, (LCD_RAM_WIDTH / 2) - 1));
     row = max(0, min(row, LCD_MAX_LINES - 1));
+    lcd_lock();
     pifacecad_lcd_set_cursor_address(colrow2address(col, row));
-    return cur_address;
+    const uint8_t address = lcd->cur_address;
+    lcd_unlock();
+    return address;
 }
 
 void pifacecad_lcd_set_cursor_address(uint8_t address)
 {
-    cur_address = address % LCD_RAM_WIDTH;
-    pifacecad_lcd_send_command(LCD_SETDDRAMADDR | cur_address);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_set_cursor_address, address, 0);
+    lcd_lock();
+    lcd->cur_address = address % LCD_RAM_WIDTH;
+    pifacecad_lcd_send_command(LCD_SETDDRAMADDR | lcd->cur_address);
+    lcd_unlock();
 }
 
 uint8_t pifacecad_lcd_get_cursor_address(void)
 {
-    return cur_address;
+    lcd_lock();
+    const uint8_t address = lcd->cur_address;
+    lcd_unlock();
+    return address;
 }
 
 /********************************************************************
@@ -171,9 +555,12 @@ uint8_t pifacecad_lcd_get_cursor_address(void)
 
 void pifacecad_lcd_clear(void)
 {
+    RT_ROUTE(RT_VOID, pifacecad_lcd_clear, 0, 0);
+    lcd_lock();
     pifacecad_lcd_send_command(LCD_CLEARDISPLAY);
-    sleep_ns(DELAY_CLEAR_NS);		/* 2.6 ms  - added JW 2014/06/26 */
-    cur_address = 0;
+    lcd_busy_for(DELAY_CLEAR_NS);	/* 2.6 ms  - added JW 2014/06/26 */
+    lcd->cur_address = 0;
+    lcd_unlock();
 }
 
 /********************************************************************
@@ -189,46 +576,61 @@ void pifacecad_lcd_clear(void)
 
 void pifacecad_lcd_home(void)
 {
+    RT_ROUTE(RT_VOID, pifacecad_lcd_home, 0, 0);
+    lcd_lock();
     pifacecad_lcd_send_command(LCD_RETURNHOME);
-    sleep_ns(DELAY_CLEAR_NS);		/* 2.6 ms  - added JW 2014/06/26 */
-    cur_address = 0;
+    lcd_busy_for(DELAY_CLEAR_NS);	/* 2.6 ms  - added JW 2014/06/26 */
+    lcd->cur_address = 0;
+    lcd_unlock();
 }
 
 
 void pifacecad_lcd_display_on(void)
 {
-    cur_display_control |= LCD_DISPLAYON;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_display_on, 0, 0);
+    lcd_lock();
+    lcd_set_display_control(lcd->cur_display_control | LCD_DISPLAYON);
+    lcd_unlock();
 }
 
 void pifacecad_lcd_display_off(void)
 {
-    cur_display_control &= 0xff ^ LCD_DISPLAYON;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_display_off, 0, 0);
+    lcd_lock();
+    lcd_set_display_control(lcd->cur_display_control & (0xff ^ LCD_DISPLAYON));
+    lcd_unlock();
 }
 
 void pifacecad_lcd_blink_on(void)
 {
-    cur_display_control |= LCD_BLINKON;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_blink_on, 0, 0);
+    lcd_lock();
+    lcd_set_display_control(lcd->cur_display_control | LCD_BLINKON);
+    lcd_unlock();
 }
 
 void pifacecad_lcd_blink_off(void)
 {
-    cur_display_control &= 0xff ^ LCD_BLINKON;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_blink_off, 0, 0);
+    lcd_lock();
+    lcd_set_display_control(lcd->cur_display_control & (0xff ^ LCD_BLINKON));
+    lcd_unlock();
 }
 
 void pifacecad_lcd_cursor_on(void)
 {
-    cur_display_control |= LCD_CURSORON;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_cursor_on, 0, 0);
+    lcd_lock();
+    lcd_set_display_control(lcd->cur_display_control | LCD_CURSORON);
+    lcd_unlock();
 }
 
 void pifacecad_lcd_cursor_off(void)
 {
-    cur_display_control &= 0xff ^ LCD_CURSORON;
-    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_cursor_off, 0, 0);
+    lcd_lock();
+    lcd_set_display_control(lcd->cur_display_control & (0xff ^ LCD_CURSORON));
+    lcd_unlock();
 }
 
 void pifacecad_lcd_backlight_on(void)
@@ -243,6 +645,7 @@ void pifacecad_lcd_backlight_off(void)
 
 void pifacecad_lcd_move_left(void)
 {
+    RT_ROUTE(RT_VOID, pifacecad_lcd_move_left, 0, 0);
     pifacecad_lcd_send_command(LCD_CURSORSHIFT | \
                                LCD_DISPLAYMOVE | \
                                LCD_MOVELEFT);
@@ -250,6 +653,7 @@ void pifacecad_lcd_move_left(void)
 
 void pifacecad_lcd_move_right(void)
 {
+    RT_ROUTE(RT_VOID, pifacecad_lcd_move_right, 0, 0);
     pifacecad_lcd_send_command(LCD_CURSORSHIFT | \
                                LCD_DISPLAYMOVE | \
                                LCD_MOVERIGHT);
@@ -257,105 +661,322 @@ void pifacecad_lcd_move_right(void)
 
 void pifacecad_lcd_left_to_right(void)
 {
-    cur_entry_mode |= LCD_ENTRYLEFT;
-    pifacecad_lcd_send_command(LCD_ENTRYMODESET | cur_entry_mode);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_left_to_right, 0, 0);
+    lcd_lock();
+    lcd_set_entry_mode(lcd->cur_entry_mode | LCD_ENTRYLEFT);
+    lcd_unlock();
 }
 
 void pifacecad_lcd_right_to_left(void)
 {
-    cur_entry_mode &= 0xff ^ LCD_ENTRYLEFT;
-    pifacecad_lcd_send_command(LCD_ENTRYMODESET | cur_entry_mode);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_right_to_left, 0, 0);
+    lcd_lock();
+    lcd_set_entry_mode(lcd->cur_entry_mode & (0xff ^ LCD_ENTRYLEFT));
+    lcd_unlock();
 }
 
 // This will 'right justify' text from the cursor
 void pifacecad_lcd_autoscroll_on(void)
 {
-    cur_display_control |= LCD_ENTRYSHIFTINCREMENT;
-    pifacecad_lcd_send_command(LCD_ENTRYMODESET | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_autoscroll_on, 0, 0);
+    lcd_lock();
+    lcd_set_entry_mode(lcd->cur_entry_mode | LCD_ENTRYSHIFTINCREMENT);
+    lcd_unlock();
 }
 
 // This will 'left justify' text from the cursor
 void pifacecad_lcd_autoscroll_off(void)
 {
-    cur_display_control &= 0xff ^ LCD_ENTRYSHIFTINCREMENT;
-    pifacecad_lcd_send_command(LCD_ENTRYMODESET | cur_display_control);
+    RT_ROUTE(RT_VOID, pifacecad_lcd_autoscroll_off, 0, 0);
+    lcd_lock();
+    lcd_set_entry_mode(lcd->cur_entry_mode & (0xff ^ LCD_ENTRYSHIFTINCREMENT));
+    lcd_unlock();
 }
 
 void pifacecad_lcd_write_custom_bitmap(uint8_t location)
 {
-    pifacecad_lcd_send_command(LCD_SETDDRAMADDR | cur_address);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_write_custom_bitmap, location, 0);
+    lcd_lock();
+    pifacecad_lcd_send_command(LCD_SETDDRAMADDR | lcd->cur_address);
     pifacecad_lcd_send_data(location);
-    cur_address++;
+    lcd->cur_address++;
+    lcd_unlock();
 }
 
 void pifacecad_lcd_store_custom_bitmap(uint8_t location, uint8_t bitmap[])
 {
-    location &= 0x7; // we only have 8 locations 0-7
-    pifacecad_lcd_send_command(LCD_SETCGRAMADDR | (location << 3));
-    int i;
-    for (i = 0; i < 8; i++) {
-        pifacecad_lcd_send_data(bitmap[i]);
-    }
+    RT_ROUTE(RT_VOID_U8_PTR,
+             pifacecad_lcd_store_custom_bitmap, location, bitmap);
+    cad_lcd_cgram_write(location, 0, bitmap, 8);
 }
 
 void pifacecad_lcd_send_command(uint8_t command)
 {
-    pifacecad_lcd_set_rs(0);
-    pifacecad_lcd_send_byte(command);
-    sleep_ns(DELAY_SETTLE_NS);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_send_command, command, 0);
+    struct lcd_batch batch;
+    lcd_lock();
+    lcd_batch_init(&batch);
+    lcd_batch_add(&batch, 0, command);
+    lcd_batch_flush(&batch);
+    lcd_unlock();
 }
 
 void pifacecad_lcd_send_data(uint8_t data)
 {
-    pifacecad_lcd_set_rs(1);
-    pifacecad_lcd_send_byte(data);
-    sleep_ns(DELAY_SETTLE_NS);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_send_data, data, 0);
+    struct lcd_batch batch;
+    lcd_lock();
+    lcd_batch_init(&batch);
+    lcd_batch_add(&batch, 1, data);
+    lcd_batch_flush(&batch);
+    lcd_unlock();
 }
 
 void pifacecad_lcd_send_byte(uint8_t b)
 {
-    // get current lcd port state and clear the data bits
-    uint8_t current_state = mcp23s17_read_reg(LCD_PORT, hw_addr, mcp23s17_fd);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_send_byte, b, 0);
+    lcd_lock();
+    // get current lcd port state (from the shadow) and clear the data bits
+    uint8_t current_state = lcd_port_get();
     current_state &= 0xF0; // clear the data bits
 
     // send first nibble (0bXXXX0000)
     uint8_t new_byte = current_state | ((b >> 4) & 0xF);  // set nibble
-    mcp23s17_write_reg(new_byte, LCD_PORT, hw_addr, mcp23s17_fd);
+    lcd_port_put(new_byte);
     pifacecad_lcd_pulse_enable();
 
     // send second nibble (0b0000XXXX)
     new_byte = current_state | (b & 0xF);  // set nibble
-    mcp23s17_write_reg(new_byte, LCD_PORT, hw_addr, mcp23s17_fd);
+    lcd_port_put(new_byte);
     pifacecad_lcd_pulse_enable();
+    lcd_unlock();
 }
 
 void pifacecad_lcd_set_rs(uint8_t state)
 {
-    mcp23s17_write_bit(state, PIN_RS, LCD_PORT, hw_addr, mcp23s17_fd);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_set_rs, state, 0);
+    lcd_port_write_bit(state, PIN_RS);
 }
 
 void pifacecad_lcd_set_rw(uint8_t state)
 {
-    mcp23s17_write_bit(state, PIN_RW, LCD_PORT, hw_addr, mcp23s17_fd);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_set_rw, state, 0);
+    lcd_port_write_bit(state, PIN_RW);
 }
 
 void pifacecad_lcd_set_enable(uint8_t state)
 {
-    mcp23s17_write_bit(state, PIN_ENABLE, LCD_PORT, hw_addr, mcp23s17_fd);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_set_enable, state, 0);
+    lcd_port_write_bit(state, PIN_ENABLE);
 }
 
 void pifacecad_lcd_set_backlight(uint8_t state)
 {
-    mcp23s17_write_bit(state, PIN_BACKLIGHT, LCD_PORT, hw_addr, mcp23s17_fd);
+    RT_ROUTE(RT_VOID_U8, pifacecad_lcd_set_backlight, state, 0);
+    lcd_port_write_bit(state, PIN_BACKLIGHT);
 }
 
 /* pulse the enable pin */
 void pifacecad_lcd_pulse_enable(void)
 {
+    RT_ROUTE(RT_VOID, pifacecad_lcd_pulse_enable, 0, 0);
+    lcd_lock();
+    lcd_wait_ready();
     pifacecad_lcd_set_enable(1);
     sleep_ns(DELAY_PULSE_NS);
     pifacecad_lcd_set_enable(0);
     sleep_ns(DELAY_PULSE_NS);
+    lcd_unlock();
+}
+
+int pifacecad_lcd_check(void)
+{
+    RT_ROUTE_RET(int, RT_INT, pifacecad_lcd_check, 0, 0);
+    lcd_lock();
+    if (!lcd->synced) {
+        lcd_unlock();
+        errno = EAGAIN; // nothing to compare against until it is set up
+        return -1;
+    }
+    if (cad_group_active() || cad_sim_active()) {
+        // every board would answer at once, or nothing would answer
+        errno = cad_group_active() ? EBUSY : ENOTSUP;
+        lcd_unlock();
+        return -1;
+    }
+
+    // a controller which is half way through a byte answers with the
+    // wrong nibbles, so its address counter won't match ours
+    const uint8_t expected = lcd->ac_cgram ? lcd->ac & 0x3f : lcd->ac;
+    if (lcd_read_status() == expected) {
+        lcd_unlock();
+        return 0;
+    }
+    pifacecad_lcd_resync();
+    lcd_unlock();
+    return 1;
+}
+
+void pifacecad_lcd_resync(void)
+{
+    RT_ROUTE(RT_VOID, pifacecad_lcd_resync, 0, 0);
+    lcd_lock();
+    uint8_t ddram[LCD_RAM_WIDTH], cgram[8 * 8];
+    memcpy(ddram, lcd->ddram, sizeof(ddram));
+    memcpy(cgram, lcd->cgram, sizeof(cgram));
+    const uint8_t ac = lcd->ac, ac_cgram = lcd->ac_cgram;
+    const uint8_t display_shift = lcd->display_shift;
+    const uint8_t entry_mode = lcd->cur_entry_mode;
+
+    // Three 0x3 nibbles put the controller in 8-bit mode whichever nibble
+    // it was waiting for. If it was waiting for a second nibble the first
+    // one completes a command 0xX3, the slowest of which is return home,
+    // so give that time to finish. No power-on delays, no clear.
+    const uint8_t backlight = lcd_port_get() & (1 << PIN_BACKLIGHT);
+    lcd_port_put(backlight | 0x3);
+    pifacecad_lcd_pulse_enable();
+    lcd_busy_for(DELAY_CLEAR_NS);
+
+    lcd_port_put(backlight | 0x3);
+    pifacecad_lcd_pulse_enable();
+    lcd_busy_for(DELAY_SETTLE_NS);
+
+    lcd_port_put(backlight | 0x3);
+    pifacecad_lcd_pulse_enable();
+    lcd_busy_for(DELAY_SETTLE_NS);
+
+    lcd_port_put(backlight | 0x2);
+    pifacecad_lcd_pulse_enable();
+    lcd_busy_for(DELAY_SETTLE_NS);
+
+    pifacecad_lcd_send_command(LCD_FUNCTIONSET | lcd->cur_function_set);
+    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | lcd->cur_display_control);
+
+    // the display may or may not have moved, start from home
+    pifacecad_lcd_send_command(LCD_RETURNHOME);
+    lcd_busy_for(DELAY_CLEAR_NS);
+
+    // put the contents back without shifting the display as we go
+    lcd->cur_entry_mode = LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT;
+    pifacecad_lcd_send_command(LCD_ENTRYMODESET | lcd->cur_entry_mode);
+    int i, j;
+    for (i = 0; i < 8; i++) {
+        if (lcd->cgram_stored & (1 << i)) {
+            pifacecad_lcd_send_command(LCD_SETCGRAMADDR | (i << 3));
+            for (j = 0; j < 8; j++) {
+                pifacecad_lcd_send_data(cgram[i * 8 + j]);
+            }
+        }
+    }
+    for (i = 0; i < LCD_MAX_LINES; i++) {
+        pifacecad_lcd_send_command(LCD_SETDDRAMADDR | ROW_OFFSETS[i]);
+        for (j = 0; j < LCD_ROW_WIDTH; j++) {
+            pifacecad_lcd_send_data(ddram[i * LCD_ROW_WIDTH + j]);
+        }
+    }
+
+    // shift back the shortest way round
+    const int shift_left = display_shift <= LCD_ROW_WIDTH / 2;
+    const int shifts = shift_left ? display_shift : LCD_ROW_WIDTH - display_shift;
+    for (i = 0; i < shifts; i++) {
+        pifacecad_lcd_send_command(LCD_CURSORSHIFT | \
+                                   LCD_DISPLAYMOVE | \
+                                   (shift_left ? LCD_MOVELEFT : LCD_MOVERIGHT));
+    }
+    pifacecad_lcd_send_command((ac_cgram ? LCD_SETCGRAMADDR : LCD_SETDDRAMADDR) \
+                               | ac);
+    lcd->cur_entry_mode = entry_mode;
+    pifacecad_lcd_send_command(LCD_ENTRYMODESET | lcd->cur_entry_mode);
+    lcd_unlock();
+}
+
+int pifacecad_lcd_read_address(void)
+{
+    RT_ROUTE_RET(int, RT_INT, pifacecad_lcd_read_address, 0, 0);
+    lcd_lock();
+    int status = -1;
+    if (cad_group_active()) {
+        errno = EBUSY;
+    } else if (cad_sim_active()) {
+        errno = ENOTSUP;
+    } else if ((status = lcd_read_status()) < 0) {
+        errno = ETIMEDOUT;
+    }
+    lcd_unlock();
+    return status;
+}
+
+int pifacecad_lcd_read_ddram(uint8_t ddram[])
+{
+    RT_ROUTE_RET(int, RT_INT_PTR, pifacecad_lcd_read_ddram, ddram, 0);
+    struct lcd_read read;
+    lcd_lock();
+    if (lcd_read_begin(&read) < 0) {
+        lcd_unlock();
+        return -1;
+    }
+    int i;
+    for (i = 0; i < LCD_MAX_LINES; i++) {
+        pifacecad_lcd_send_command(LCD_SETDDRAMADDR | ROW_OFFSETS[i]);
+        lcd_read_bytes(1, &ddram[i * LCD_ROW_WIDTH], LCD_ROW_WIDTH);
+    }
+    lcd_read_end(&read);
+    lcd_unlock();
+    return 0;
+}
+
+int pifacecad_lcd_read_cgram(uint8_t cgram[])
+{
+    RT_ROUTE_RET(int, RT_INT_PTR, pifacecad_lcd_read_cgram, cgram, 0);
+    struct lcd_read read;
+    lcd_lock();
+    if (lcd_read_begin(&read) < 0) {
+        lcd_unlock();
+        return -1;
+    }
+    pifacecad_lcd_send_command(LCD_SETCGRAMADDR);
+    lcd_read_bytes(1, cgram, 8 * 8);
+    int i;
+    for (i = 0; i < 8 * 8; i++) {
+        cgram[i] &= 0x1f; // rows are five dots wide, the rest is noise
+    }
+    lcd_read_end(&read);
+    lcd_unlock();
+    return 0;
+}
+
+int pifacecad_lcd_reload(void)
+{
+    RT_ROUTE_RET(int, RT_INT, pifacecad_lcd_reload, 0, 0);
+    uint8_t ddram[LCD_RAM_WIDTH], cgram[8 * 8];
+    lcd_lock();
+    // reading RAM moves the address counter, so find out where it is first
+    const int address = pifacecad_lcd_read_address();
+    if (address < 0 || \
+            pifacecad_lcd_read_ddram(ddram) < 0 || \
+            pifacecad_lcd_read_cgram(cgram) < 0) {
+        lcd_unlock();
+        return -1;
+    }
+    memcpy(lcd->ddram, ddram, sizeof(ddram));
+    memcpy(lcd->cgram, cgram, sizeof(cgram));
+    lcd->cgram_stored = 0xff;
+    if (!lcd->synced) {
+        // the rest can't be read back, so set it as lcd_init leaves it
+        lcd->cur_entry_mode = LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT;
+        pifacecad_lcd_send_command(LCD_ENTRYMODESET | lcd->cur_entry_mode);
+        lcd->cur_display_control = \
+            LCD_DISPLAYON | LCD_CURSORON | LCD_BLINKON;
+        pifacecad_lcd_send_command(
+            LCD_DISPLAYCONTROL | lcd->cur_display_control);
+        pifacecad_lcd_send_command(LCD_RETURNHOME); // display shift 0
+        lcd->synced = 1;
+    }
+    lcd->cur_address = address;
+    pifacecad_lcd_send_command(LCD_SETDDRAMADDR | address);
+    lcd_changed = 1; // the mirror gets the new contents too
+    lcd_unlock();
+    return 0;
 }
 
 uint8_t colrow2address(uint8_t col, uint8_t row)
@@ -370,7 +991,651 @@ uint8_t address2col(uint8_t address)
 
 uint8_t address2row(uint8_t address)
 {
-    return address > ROW_OFFSETS[1] ? 1 : 0;
+    return address >= ROW_OFFSETS[1] ? 1 : 0;
+}
+
+/* Runs entry on the real-time worker and returns 1, or returns 0 if the
+ * caller should carry on itself: there is no worker, this is the worker,
+ * or the caller holds the LCD lock (it is part of a bigger operation
+ * and the worker might be waiting for the lock). */
+static int rt_route(struct rt_entry * entry)
+{
+    if (lock_depth > 0 || !cad_rt_routing()) {
+        return 0;
+    }
+    pifacecad_rt_call(rt_entry_run, entry);
+    errno = entry->error;
+    return 1;
+}
+
+static void rt_entry_run(void * arg)
+{
+    struct rt_entry * e = arg;
+    switch (e->kind) {
+    case RT_VOID:
+        ((void (*)(void)) e->func)();
+        break;
+    case RT_VOID_U8:
+        ((void (*)(uint8_t)) e->func)(e->arg0);
+        break;
+    case RT_VOID_U8_PTR:
+        ((void (*)(uint8_t, uint8_t *)) e->func)(e->arg0,
+                                                 (uint8_t *) e->arg1);
+        break;
+    case RT_U8:
+        e->ret = ((uint8_t (*)(void)) e->func)();
+        break;
+    case RT_U8_U8_U8:
+        e->ret = ((uint8_t (*)(uint8_t, uint8_t)) e->func)(e->arg0, e->arg1);
+        break;
+    case RT_U8_STR_SIZE:
+        e->ret = ((uint8_t (*)(const char *, size_t)) e->func)(
+            (const char *) e->arg0, e->arg1);
+        break;
+    case RT_U8_SEGS_INT:
+        e->ret = ((uint8_t (*)(const struct pifacecad_lcd_segment *, int))
+                  e->func)((const struct pifacecad_lcd_segment *) e->arg0,
+                           e->arg1);
+        break;
+    case RT_INT:
+        e->ret = ((int (*)(void)) e->func)();
+        break;
+    case RT_INT_PTR:
+        e->ret = ((int (*)(uint8_t *)) e->func)((uint8_t *) e->arg0);
+        break;
+    }
+    e->error = errno;
+}
+
+static void local_state_init(void)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&local_state.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    local_state.magic = LCD_STATE_MAGIC;
+}
+
+static void lcd_lock(void)
+{
+    pthread_once(&local_state_once, local_state_init);
+    if (pthread_mutex_lock(&lcd->lock) == EOWNERDEAD) {
+        // another process died holding the lock, possibly half way
+        // through a byte: re-read the port and check the controller
+        lcd->port_valid = 0;
+        pthread_mutex_consistent(&lcd->lock);
+        lock_depth++;
+        pifacecad_lcd_check();
+        return;
+    }
+    lock_depth++;
+}
+
+static void lcd_unlock(void)
+{
+    // the outermost unlock finishes a whole operation, publish it
+    if (--lock_depth == 0 && lcd_changed) {
+        lcd_changed = 0;
+        cad_mirror_commit();
+        cad_latency_commit();
+    }
+    pthread_mutex_unlock(&lcd->lock);
+}
+
+/* returns the cached GPIOB state, only reading the chip when we have
+ * never seen it before */
+static uint8_t lcd_port_get(void)
+{
+    if (!lcd->port_valid) {
+        lcd->cur_port = cad_read_reg(LCD_PORT, hw_addr);
+        lcd->port_valid = 1;
+    }
+    return lcd->cur_port;
+}
+
+static void lcd_port_put(uint8_t value)
+{
+    if (lcd->port_valid && lcd->cur_port == value) {
+        return;
+    }
+    cad_write_reg(value, LCD_PORT, hw_addr);
+    lcd->cur_port = value;
+    lcd->port_valid = 1;
+    lcd_changed = 1;
+}
+
+static void lcd_port_write_bit(uint8_t state, uint8_t bit_num)
+{
+    lcd_lock();
+    uint8_t value = lcd_port_get();
+    if (state) {
+        value |= 1 << bit_num;
+    } else {
+        value &= 0xff ^ (1 << bit_num);
+    }
+    lcd_port_put(value);
+    lcd_unlock();
+}
+
+/* only talk to the controller if the setting actually changes */
+static void lcd_set_display_control(uint8_t display_control)
+{
+    if (lcd->synced && lcd->cur_display_control == display_control) {
+        return;
+    }
+    lcd->cur_display_control = display_control;
+    pifacecad_lcd_send_command(LCD_DISPLAYCONTROL | display_control);
+}
+
+static void lcd_set_entry_mode(uint8_t entry_mode)
+{
+    if (lcd->synced && lcd->cur_entry_mode == entry_mode) {
+        return;
+    }
+    lcd->cur_entry_mode = entry_mode;
+    pifacecad_lcd_send_command(LCD_ENTRYMODESET | entry_mode);
+}
+
+static void lcd_batch_init(struct lcd_batch * batch)
+{
+    batch->num = 0;
+}
+
+/* queues a byte for the controller. Our copy of the controller state is
+ * updated straight away, the byte goes out with the rest of the batch. */
+static void lcd_batch_add(struct lcd_batch * batch, uint8_t rs, uint8_t b)
+{
+    if (batch->num == LCD_BATCH_LEN) {
+        lcd_batch_flush(batch);
+    }
+    batch->rs[batch->num] = rs ? 1 : 0; // indexes lcd_seqs
+    batch->bytes[batch->num] = b;
+    batch->num++;
+    if (rs) {
+        lcd_track_data(b);
+    } else {
+        lcd_track_command(b);
+    }
+}
+
+/* points the address counter at address unless it already is (after
+ * set_cursor, say) */
+static void lcd_batch_address(struct lcd_batch * batch, uint8_t address)
+{
+    if (!lcd->synced || lcd->ac_cgram || lcd->ac != address) {
+        lcd_batch_add(batch, 0, LCD_SETDDRAMADDR | address);
+    }
+}
+
+/* queues message, moving to the start of the second row at '\n' */
+static void lcd_batch_text(struct lcd_batch * batch,
+                           const char * message,
+                           size_t len)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (message[i] == '\n') {
+            lcd->cur_address = colrow2address(0, 1);
+            lcd_batch_add(batch, 0, LCD_SETDDRAMADDR | lcd->cur_address);
+        } else {
+            lcd_batch_add(batch, 1, message[i]);
+            lcd->cur_address++;
+        }
+    }
+}
+
+/* sends the queued bytes as one SPI message, one transfer per byte with
+ * the controller's execution time as the delay between them. Falls back
+ * to a register write per nibble/pulse if the message can't be sent. */
+static void lcd_batch_flush(struct lcd_batch * batch)
+{
+    if (batch->num == 0) {
+        return;
+    }
+    const uint8_t backlight = (lcd_port_get() >> PIN_BACKLIGHT) & 1;
+    // when each transfer goes out, for the backlight PWM level
+    uint64_t time_ns = cad_now_ns();
+    time_ns = time_ns > lcd->busy_until_ns ? time_ns : lcd->busy_until_ns;
+    int visible = 0;
+    int i;
+    for (i = 0; i < batch->num; i++) {
+        const uint8_t rs = batch->rs[i], b = batch->bytes[i];
+        const uint8_t bl = cad_pwm_backlight(time_ns, backlight);
+        uint8_t * tx = batch->tx[i];
+        tx[0] = MCP23S17_OPCODE_WRITE(hw_addr);
+        tx[1] = LCD_PORT;
+        memcpy(&tx[2], lcd_seqs[bl][rs][b], LCD_SEQ_LEN);
+        memset(&batch->transfers[i], 0, sizeof(struct spi_ioc_transfer));
+        batch->transfers[i].tx_buf = (unsigned long) tx;
+        batch->transfers[i].len = LCD_BATCH_SEG_LEN;
+        batch->transfers[i].delay_usecs = lcd_exec_ns(rs, b) / 1000;
+        batch->transfers[i].cs_change = 1; // next transfer is a new command
+        visible |= rs | (b == LCD_CLEARDISPLAY);
+        time_ns += lcd_exec_ns(rs, b);
+    }
+    // the last byte's execution time is left for the next operation
+    const int last = batch->num - 1;
+    batch->transfers[last].delay_usecs = 0;
+    batch->transfers[last].cs_change = 0;
+
+    lcd_wait_ready();
+    if (!cad_sim_active() && \
+            ioctl(mcp23s17_fd, SPI_IOC_MESSAGE(batch->num),
+                  batch->transfers) >= 0) {
+        lcd->cur_port = batch->tx[last][LCD_BATCH_SEG_LEN - 1];
+        lcd->port_valid = 1;
+        lcd_changed = 1;
+    } else {
+        for (i = 0; i < batch->num; i++) {
+            pifacecad_lcd_set_rs(batch->rs[i]);
+            pifacecad_lcd_send_byte(batch->bytes[i]);
+            if (i < last) {
+                lcd_busy_for(lcd_exec_ns(batch->rs[i], batch->bytes[i]));
+            }
+        }
+    }
+    if (visible) {
+        cad_latency_visible(); // last enable pulse of a visible change
+    }
+    lcd_busy_for(lcd_exec_ns(batch->rs[last], batch->bytes[last]));
+    batch->num = 0;
+}
+
+/* how long the controller takes to carry out a byte */
+static long lcd_exec_ns(uint8_t rs, uint8_t b)
+{
+    // clear display and return home are the only instructions below 0x04
+    return !rs && b < (LCD_RETURNHOME << 1) ? DELAY_CLEAR_NS : DELAY_SETTLE_NS;
+}
+
+void cad_lock(void)
+{
+    lcd_lock();
+}
+
+void cad_unlock(void)
+{
+    lcd_unlock();
+}
+
+uint8_t cad_read_reg(uint8_t reg, uint8_t addr)
+{
+    if (cad_sim_active()) {
+        return cad_sim_read_reg(reg, addr);
+    }
+    return mcp23s17_read_reg(reg, addr, mcp23s17_fd);
+}
+
+void cad_write_reg(uint8_t data, uint8_t reg, uint8_t addr)
+{
+    if (cad_sim_active()) {
+        cad_sim_write_reg(data, reg, addr);
+        return;
+    }
+    mcp23s17_write_reg(data, reg, addr, mcp23s17_fd);
+}
+
+int cad_spi_fd(void)
+{
+    return mcp23s17_fd;
+}
+
+uint8_t cad_hw_addr(void)
+{
+    return hw_addr;
+}
+
+int cad_read_regs(const uint8_t * regs, uint8_t * values, int num)
+{
+    struct spi_ioc_transfer transfers[MAX_BURST_REGS];
+    uint8_t tx[MAX_BURST_REGS][3], rx[MAX_BURST_REGS][3];
+    int i;
+
+    if (num <= MAX_BURST_REGS && !cad_sim_active()) {
+        memset(transfers, 0, sizeof(transfers));
+        for (i = 0; i < num; i++) {
+            tx[i][0] = MCP23S17_OPCODE_READ(hw_addr);
+            tx[i][1] = regs[i];
+            tx[i][2] = 0;
+            transfers[i].tx_buf = (unsigned long) tx[i];
+            transfers[i].rx_buf = (unsigned long) rx[i];
+            transfers[i].len = 3;
+            transfers[i].cs_change = 1; // new MCP23S17 command each time
+        }
+        transfers[num - 1].cs_change = 0;
+        if (ioctl(mcp23s17_fd, SPI_IOC_MESSAGE(num), transfers) >= 0) {
+            for (i = 0; i < num; i++) {
+                values[i] = rx[i][2];
+            }
+            return 0;
+        }
+    }
+
+    for (i = 0; i < num; i++) {
+        values[i] = cad_read_reg(regs[i], hw_addr);
+    }
+    return 1;
+}
+
+uint64_t cad_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void cad_lcd_snapshot(struct pifacecad_display_snapshot * snapshot)
+{
+    lcd_lock();
+    memcpy(snapshot->ddram, lcd->ddram, sizeof(snapshot->ddram));
+    memcpy(snapshot->cgram, lcd->cgram, sizeof(snapshot->cgram));
+    snapshot->cursor_address = lcd->ac_cgram ? lcd->cur_address : lcd->ac;
+    snapshot->display_control = lcd->cur_display_control;
+    snapshot->entry_mode = lcd->cur_entry_mode;
+    snapshot->display_shift = lcd->display_shift;
+    snapshot->backlight = (lcd->cur_port >> PIN_BACKLIGHT) & 1;
+    snapshot->updated_ns = cad_now_ns();
+    lcd_unlock();
+}
+
+int cad_lcd_cgram_get(uint8_t location, uint8_t bitmap[])
+{
+    location &= 0x7;
+    lcd_lock();
+    const int known = (lcd->cgram_stored >> location) & 1;
+    if (known) {
+        memcpy(bitmap, &lcd->cgram[location * 8], 8);
+    }
+    lcd_unlock();
+    return known ? 0 : -1;
+}
+
+void cad_lcd_cgram_write(uint8_t location,
+                         uint8_t first_row,
+                         const uint8_t * rows,
+                         int num)
+{
+    location &= 0x7; // we only have 8 locations 0-7
+    struct lcd_batch batch;
+    lcd_lock();
+    lcd_batch_init(&batch);
+    lcd_batch_add(&batch, 0, LCD_SETCGRAMADDR | (location << 3) | first_row);
+    int i;
+    for (i = 0; i < num && first_row + i < 8; i++) {
+        lcd_batch_add(&batch, 1, rows[i]);
+    }
+    lcd_batch_flush(&batch);
+    lcd_unlock();
+}
+
+int cad_lcd_put_backlight(uint8_t state, int publish)
+{
+    lcd_lock();
+    const uint8_t port = lcd_port_get();
+    const int write = ((port >> PIN_BACKLIGHT) & 1) != !!state;
+    const int changed = lcd_changed;
+    if (write) {
+        lcd_port_put(port ^ (1 << PIN_BACKLIGHT));
+    }
+    lcd_changed = publish ? 1 : changed;
+    lcd_unlock();
+    return write;
+}
+
+void cad_lcd_set_display_control(uint8_t display_control)
+{
+    lcd_lock();
+    lcd_set_display_control(display_control);
+    lcd_unlock();
+}
+
+void cad_lcd_set_display_shift(uint8_t shift)
+{
+    shift %= LCD_ROW_WIDTH;
+    struct lcd_batch batch;
+    lcd_lock();
+    lcd_batch_init(&batch);
+    if (shift == 0 && (!lcd->synced || lcd->display_shift != 0)) {
+        lcd_batch_add(&batch, 0, LCD_RETURNHOME);
+    } else {
+        // moving the display left brings later columns into view
+        const int left = \
+            (shift + LCD_ROW_WIDTH - lcd->display_shift) % LCD_ROW_WIDTH;
+        const int move_left = left <= LCD_ROW_WIDTH / 2;
+        const int moves = move_left ? left : LCD_ROW_WIDTH - left;
+        int i;
+        for (i = 0; i < moves; i++) {
+            lcd_batch_add(&batch, 0, LCD_CURSORSHIFT | LCD_DISPLAYMOVE | \
+                          (move_left ? LCD_MOVELEFT : LCD_MOVERIGHT));
+        }
+    }
+    lcd_batch_flush(&batch);
+    lcd_unlock();
+}
+
+uint8_t cad_lcd_write_runs(const struct cad_lcd_run * runs, int num)
+{
+    struct lcd_batch batch;
+    lcd_lock();
+    lcd_batch_init(&batch);
+    int i;
+    size_t j;
+    for (i = 0; i < num; i++) {
+        lcd->cur_address = runs[i].address;
+        lcd_batch_address(&batch, lcd->cur_address);
+        for (j = 0; j < runs[i].len; j++) {
+            lcd_batch_add(&batch, 1, runs[i].buf[j]);
+            lcd->cur_address++;
+        }
+    }
+    lcd_batch_flush(&batch);
+    const uint8_t address = lcd->cur_address;
+    lcd_unlock();
+    return address;
+}
+
+/* keep our copy of the controller state up to date after a command */
+static void lcd_track_command(uint8_t command)
+{
+    if (command & LCD_SETDDRAMADDR) {
+        lcd->ac = command & 0x7f;
+        lcd->ac_cgram = 0;
+    } else if (command & LCD_SETCGRAMADDR) {
+        lcd->ac = command & 0x3f;
+        lcd->ac_cgram = 1;
+    } else if (command & LCD_FUNCTIONSET) {
+        // nothing to track
+    } else if (command & LCD_CURSORSHIFT) {
+        const int right = command & LCD_MOVERIGHT;
+        if (command & LCD_DISPLAYMOVE) {
+            lcd->display_shift = \
+                (lcd->display_shift + (right ? LCD_ROW_WIDTH - 1 : 1)) % \
+                LCD_ROW_WIDTH;
+        } else {
+            lcd->ac = lcd_ac_step(lcd->ac, right);
+        }
+    } else if (command & LCD_DISPLAYCONTROL) {
+        // tracked by the callers
+    } else if (command & LCD_ENTRYMODESET) {
+        // tracked by the callers
+    } else if (command & LCD_RETURNHOME) {
+        lcd->ac = 0;
+        lcd->ac_cgram = 0;
+        lcd->display_shift = 0;
+    } else if (command & LCD_CLEARDISPLAY) {
+        memset(lcd->ddram, ' ', sizeof(lcd->ddram));
+        lcd->ac = 0;
+        lcd->ac_cgram = 0;
+        lcd->display_shift = 0;
+        lcd->cur_entry_mode |= LCD_ENTRYLEFT; // clear sets I/D
+    }
+}
+
+/* keep our copy of DDRAM/CGRAM up to date after writing data */
+static void lcd_track_data(uint8_t data)
+{
+    const int increment = lcd->cur_entry_mode & LCD_ENTRYLEFT;
+    if (lcd->ac_cgram) {
+        lcd->cgram[lcd->ac & 0x3f] = data;
+        lcd->cgram_stored |= 1 << ((lcd->ac >> 3) & 0x7);
+        lcd->ac = (lcd->ac + (increment ? 1 : -1)) & 0x3f;
+    } else {
+        lcd->ddram[ddram_index(lcd->ac)] = data;
+        lcd->ac = lcd_ac_step(lcd->ac, increment);
+        if (lcd->cur_entry_mode & LCD_ENTRYSHIFTINCREMENT) {
+            // autoscroll moves the display along with the cursor
+            lcd->display_shift = \
+                (lcd->display_shift + (increment ? 1 : LCD_ROW_WIDTH - 1)) % \
+                LCD_ROW_WIDTH;
+        }
+    }
+}
+
+/* the DDRAM address counter jumps between 0x27 and 0x40, 0x67 and 0x00 */
+static uint8_t lcd_ac_step(uint8_t ac, int increment)
+{
+    if (increment) {
+        return ac == 0x27 ? 0x40 : ac == 0x67 ? 0x00 : ac + 1;
+    } else {
+        return ac == 0x40 ? 0x27 : ac == 0x00 ? 0x67 : ac - 1;
+    }
+}
+
+static int ddram_index(uint8_t address)
+{
+    return address >= ROW_OFFSETS[1] ? \
+        LCD_ROW_WIDTH + (address - ROW_OFFSETS[1]) % LCD_ROW_WIDTH : \
+        address % LCD_ROW_WIDTH;
+}
+
+/* Reads a byte from the HD44780 (rs = 0: busy flag and address counter,
+ * rs = 1: data). */
+static uint8_t lcd_read_byte(uint8_t rs)
+{
+    uint8_t b;
+    lcd_read_bytes(rs, &b, 1);
+    return b;
+}
+
+/* Reads len bytes by turning the data pins around once and clocking out
+ * two nibbles per byte with RW high. Each data byte moves the address
+ * counter on, which takes the controller as long as a write. */
+static void lcd_read_bytes(uint8_t rs, uint8_t * buf, int len)
+{
+    lcd_lock();
+    cad_write_reg(0x0F, IODIRB, hw_addr); // D4-D7 in
+
+    uint8_t port = lcd_port_get() & (1 << PIN_BACKLIGHT);
+    port |= (rs ? 1 << PIN_RS : 0) | (1 << PIN_RW);
+    lcd_port_put(port);
+
+    int i, j;
+    for (i = 0; i < len; i++) {
+        lcd_wait_ready();
+        uint8_t b = 0;
+        for (j = 0; j < 2; j++) {
+            lcd_port_put(port | (1 << PIN_ENABLE));
+            sleep_ns(DELAY_PULSE_NS);
+            b = (b << 4) | (cad_read_reg(LCD_PORT, hw_addr) & 0xF);
+            lcd_port_put(port);
+            sleep_ns(DELAY_PULSE_NS);
+        }
+        buf[i] = b;
+        if (rs) {
+            lcd_busy_for(DELAY_SETTLE_NS);
+        }
+    }
+
+    lcd_port_put(port & (0xff ^ (1 << PIN_RW)));
+    cad_write_reg(0x00, IODIRB, hw_addr); // all out
+    lcd_unlock();
+}
+
+/* returns the address counter once the busy flag clears, -1 if it
+ * doesn't */
+static int lcd_read_status(void)
+{
+    int tries;
+    for (tries = 0; tries < LCD_CHECK_TRIES; tries++) {
+        const uint8_t status = lcd_read_byte(0);
+        if (!(status & LCD_BUSY_FLAG)) {
+            return status;
+        }
+        sleep_ns(DELAY_SETTLE_NS);
+    }
+    return -1;
+}
+
+/* Gets the controller ready for reading RAM: remembers where the address
+ * counter is and makes it count up. Returns -1 (and sets errno) if the
+ * controller can't be read. Called with the lock held. */
+static int lcd_read_begin(struct lcd_read * read)
+{
+    if (cad_group_active()) {
+        errno = EBUSY; // every board would answer at once
+        return -1;
+    }
+    if (cad_sim_active()) {
+        errno = ENOTSUP; // nothing to answer
+        return -1;
+    }
+    const int status = lcd_read_status();
+    if (status < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (lcd->synced) {
+        read->ac = lcd->ac;
+        read->ac_cgram = lcd->ac_cgram;
+    } else {
+        read->ac = status; // can't tell DDRAM from CGRAM, guess DDRAM
+        read->ac_cgram = 0;
+    }
+    // reads don't shift the display, only the direction matters
+    read->entry_mode_changed = \
+        !lcd->synced || !(lcd->cur_entry_mode & LCD_ENTRYLEFT);
+    if (read->entry_mode_changed) {
+        pifacecad_lcd_send_command(LCD_ENTRYMODESET | LCD_ENTRYLEFT);
+        if (!lcd->synced) {
+            lcd->cur_entry_mode = LCD_ENTRYLEFT; // known from now on
+        }
+    }
+    return 0;
+}
+
+/* puts back the address counter and entry mode after reading RAM */
+static void lcd_read_end(const struct lcd_read * read)
+{
+    if (read->entry_mode_changed && lcd->synced) {
+        pifacecad_lcd_send_command(LCD_ENTRYMODESET | lcd->cur_entry_mode);
+    }
+    pifacecad_lcd_send_command(
+        (read->ac_cgram ? LCD_SETCGRAMADDR : LCD_SETDDRAMADDR) | read->ac);
+}
+
+/* the controller is executing an instruction for the next nanoseconds */
+static void lcd_busy_for(long nanoseconds)
+{
+    const uint64_t until = cad_now_ns() + nanoseconds;
+    if (until > lcd->busy_until_ns) {
+        lcd->busy_until_ns = until;
+    }
+}
+
+/* waits for whatever is left of the last instruction's execution time */
+static void lcd_wait_ready(void)
+{
+    if (cad_now_ns() >= lcd->busy_until_ns) {
+        return;
+    }
+    struct timespec until;
+    until.tv_sec = lcd->busy_until_ns / 1000000000ULL;
+    until.tv_nsec = lcd->busy_until_ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) \
+            == EINTR) {
+        // signal, go back to sleep until the same deadline
+    }
 }
 
 static void sleep_ns(long nanoseconds)
@@ -22,6 +22,7 @@
 #ifndef _PIFACECAD_H
 #define _PIFACECAD_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -90,86 +91,892 @@ extern "C" {
 
 static const uint8_t ROW_OFFSETS[] = {0, 0x40};
 
+// default POSIX shared memory object holding the shared LCD state
+#define PIFACECAD_SHM_NAME "/pifacecad"
+
+// default POSIX shared memory object holding the display mirror
+#define PIFACECAD_MIRROR_NAME "/pifacecad-mirror"
+
+// most boards which can share a chip select (hardware addresses 0-7)
+#define PIFACECAD_MAX_BOARDS 8
+
+// latency measurement: samples kept for percentiles, histogram buckets
+#define PIFACECAD_LATENCY_MAX_SAMPLES 1024
+#define PIFACECAD_LATENCY_BUCKETS 24
+
+// number of switch changes kept by the sampler
+#define PIFACECAD_SAMPLER_RING_LEN 256
+
+// uinput bridge: default device name, one key per switch
+#define PIFACECAD_UINPUT_NAME "PiFace Control and Display"
+#define PIFACECAD_NUM_SWITCHES 8
+
+// bar graph orientations
+#define PIFACECAD_BAR_HORIZONTAL 0
+#define PIFACECAD_BAR_VERTICAL 1
+
+// non-blocking LCD requests which can be in flight at once
+#define PIFACECAD_ASYNC_QUEUE_LEN 32
+#define PIFACECAD_ASYNC_MAX_WRITE LCD_RAM_WIDTH // longest async write
+
+// off-screen buffers for pifacecad_screen_*
+#define PIFACECAD_MAX_SCREENS 8
+
+// pifacecad_sched_* update priorities, higher goes first
+#define PIFACECAD_PRIORITY_LOW 0
+#define PIFACECAD_PRIORITY_NORMAL 1
+#define PIFACECAD_PRIORITY_HIGH 2
+#define PIFACECAD_PRIORITY_URGENT 3
+#define PIFACECAD_NUM_PRIORITIES 4
+
+// pifacecad_pager_* pages live in DDRAM columns 0-15 and 16-31
+#define PIFACECAD_PAGER_WIDTH LCD_WIDTH
+
+// backlight PWM defaults: frequency, and the most SPI bytes per second
+// the edges may take (each one is a three byte message)
+#define PIFACECAD_PWM_HZ 200
+#define PIFACECAD_PWM_MAX_BYTES_PER_SEC 1200
+
+/**
+ * Opens and initialises a PiFace Control and Display.
+ * Returns a file descriptor for making raw SPI transactions to the
+ * MCP23S17 (for advanced users only) or -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_open();
+ *     int pifacedigital_fd = pifacecad_open(); // advanced
+ *
+ */
+int pifacecad_open(void);
+
+/**
+ * Opens a PiFace Control and Display without initialising it.
+ * Returns a file descriptor for making raw SPI transactions to the
+ * MCP23S17 (for advanced users only).
+ *
+ * Example:
+ *
+ *     pifacecad_open_noinit();
+ *     int pifacedigital_fd = pifacecad_open_noinit(); // advanced
+ *
+ */
+int pifacecad_open_noinit(void);
+
+/**
+ * Closes a PiFace Control and Display (turns off interrupts, closes file
+ * descriptor).
+ *
+ * Example:
+ *
+ *     pifacecad_close();
+ *
+ */
+void pifacecad_close(void);
+
+/**
+ * Initialised the LCD. You will not need to call this if you have called
+ * pifacecad_open.
+ *
+ * Example:
+ *
+ *     pifacecad_lcd_init();
+ *
+ */
+void pifacecad_lcd_init(void);
+
+/**
+ * Shares the LCD state (cursor address, entry mode, display control and
+ * the GPIOB shadow) with every other process that opens the same POSIX
+ * shared memory object (NULL uses PIFACECAD_SHM_NAME, which lives at
+ * /dev/shm/pifacecad). Access is serialised by a robust, process-shared
+ * lock. The object is created readable and writable by its owner and
+ * group only (0660, less the umask), so processes run by other users
+ * must share a group with the creator. Call this before pifacecad_open.
+ * Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_shared_state_open(NULL);
+ *     pifacecad_open();
+ *
+ */
+int pifacecad_shared_state_open(const char * name);
+
+/**
+ * Detaches from the shared LCD state. This process carries on with a
+ * private copy of the state.
+ *
+ * Example:
+ *
+ *     pifacecad_shared_state_close();
+ *
+ */
+void pifacecad_shared_state_close(void);
+
+/**
+ * What the library knows is on the display (see pifacecad_mirror_read).
+ */
+struct pifacecad_display_snapshot {
+    uint8_t ddram[LCD_RAM_WIDTH]; // col + row * 40
+    uint8_t cgram[8 * 8]; // custom bitmaps
+    uint8_t cursor_address;
+    uint8_t display_control; // LCD_DISPLAYON | LCD_CURSORON | LCD_BLINKON
+    uint8_t entry_mode;
+    uint8_t display_shift; // positions the display has moved left (0-39)
+    uint8_t backlight;
+    uint64_t updated_ns; // CLOCK_MONOTONIC time of the last update
+};
+
+/**
+ * Publishes a copy of the display (DDRAM, custom bitmaps, cursor,
+ * display control and backlight) to a POSIX shared memory object (NULL
+ * uses PIFACECAD_MIRROR_NAME, /dev/shm/pifacecad-mirror) after every
+ * operation which writes to the LCD. Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_mirror_open(NULL);
+ *
+ */
+int pifacecad_mirror_open(const char * name);
+
+/**
+ * Stops publishing the display mirror.
+ *
+ * Example:
+ *
+ *     pifacecad_mirror_close();
+ *
+ */
+void pifacecad_mirror_close(void);
+
+/**
+ * Reads the display mirror published by another process (NULL uses
+ * PIFACECAD_MIRROR_NAME). Never touches the SPI bus and never blocks the
+ * process writing to the display. Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     struct pifacecad_display_snapshot snapshot;
+ *     pifacecad_mirror_read(NULL, &snapshot);
+ *
+ */
+int pifacecad_mirror_read(const char * name,
+                          struct pifacecad_display_snapshot * snapshot);
+
+/**
+ * Opens and initialises several PiFace Control and Displays which share
+ * a chip select (hardware addresses hw_addrs[0] to hw_addrs[num - 1]).
+ * Hardware addressing is turned off so that every board answers the same
+ * SPI commands: all pifacecad_lcd_* calls then update every display at
+ * once, for the cost of updating one. Switches are read per board with
+ * pifacecad_group_read_switches (pifacecad_read_switches reads the first
+ * board). Reading back from the LCD and the switch sampler are not
+ * available while the group is open. Returns the SPI file descriptor or
+ * -1 on error (errno EBUSY if the switch sampler is running).
+ *
+ * Example:
+ *
+ *     const uint8_t boards[] = {0, 1, 2, 3};
+ *     pifacecad_group_open(boards, 4);
+ *     pifacecad_lcd_write("ALARM"); // on all four
+ *
+ */
+int pifacecad_group_open(const uint8_t * hw_addrs, int num);
+
+/**
+ * Closes the group, turning hardware addressing back on so that the
+ * boards can be used individually again.
+ *
+ * Example:
+ *
+ *     pifacecad_group_close();
+ *
+ */
+void pifacecad_group_close(void);
+
+/**
+ * Reads the switch port of one board in the group (index into the
+ * hw_addrs passed to pifacecad_group_open).
+ *
+ * Example:
+ *
+ *     uint8_t switch_bits = pifacecad_group_read_switches(2);
+ *
+ */
+uint8_t pifacecad_group_read_switches(int board);
+
+/**
+ * Reads the switch ports of every board in the group into switches (one
+ * byte per board), turning hardware addressing on only once. Returns the
+ * number of boards read, or -1 (errno ENODEV) if no group is open.
+ *
+ * Example:
+ *
+ *     uint8_t switch_bits[4];
+ *     pifacecad_group_read_all_switches(switch_bits);
+ *
+ */
+int pifacecad_group_read_all_switches(uint8_t * switches);
+
+/**
+ * Reads the entire switch port.
+ *
+ * Example:
+ *
+ *     uint8_t switch_bits = pifacecad_read_switches();
+ *
+ */
+uint8_t pifacecad_read_switches(void);
+
+/**
+ * Reads a single switch.
+ *
+ * Example (read switch 3):
+ *
+ *     uint8_t switch_value = pifacecad_read_switch(3);
+ *
+ */
+uint8_t pifacecad_read_switch(uint8_t switch_num);
+
+/**
+ * Enables interrupts from the switch port on the Raspberry Pi's interrupt
+ * line, for pifacecad_wait_for_switches (a simulated board raises them
+ * too). Returns 0 on success, -1 on error (no interrupt line, or an open
+ * group).
+ *
+ * Example:
+ *
+ *     if (pifacecad_enable_interrupts() < 0) {
+ *         // poll pifacecad_read_switches instead
+ *     }
+ *
+ */
+int pifacecad_enable_interrupts(void);
+
+/**
+ * Disables interrupts from the switch port. Returns 0 on success, -1 on
+ * error.
+ *
+ * Example:
+ *
+ *     pifacecad_disable_interrupts();
+ *
+ */
+int pifacecad_disable_interrupts(void);
+
+/**
+ * Waits up to timeout_ms milliseconds (-1 for ever) for a switch to
+ * change, with interrupts enabled. When one does, switches is set to the
+ * switch port as it was at the change, which a quick press and release
+ * may already have undone. A change since the switch port was last read
+ * is returned straight away. Returns a positive number when a switch
+ * changed, 0 on timeout, -1 on error.
+ *
+ * Example:
+ *
+ *     uint8_t switches;
+ *     pifacecad_enable_interrupts();
+ *     if (pifacecad_wait_for_switches(&switches, -1) > 0) {
+ *         printf("switches: 0x%02x\n", switches);
+ *     }
+ *
+ */
+int pifacecad_wait_for_switches(uint8_t * switches, int timeout_ms);
+
+/**
+ * A timestamped change of the switch port, recorded by the sampler.
+ */
+struct pifacecad_switch_sample {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC
+    uint8_t switches; // switch port state (switches are active low)
+    uint8_t changed; // bits which changed since the previous sample
+};
+
+/**
+ * Starts sampling the switch port rate_hz times a second on a background
+ * thread. Changes are kept in a ring of PIFACECAD_SAMPLER_RING_LEN
+ * samples. Returns 0 on success, -1 on error (errno EBUSY if it is
+ * already running or a group is open).
+ *
+ * Example:
+ *
+ *     pifacecad_sampler_start(1000); // 1kHz
+ *
+ */
+int pifacecad_sampler_start(unsigned int rate_hz);
+
+/**
+ * Stops the switch sampler.
+ *
+ * Example:
+ *
+ *     pifacecad_sampler_stop();
+ *
+ */
+void pifacecad_sampler_stop(void);
+
+/**
+ * Returns the last sampled state of the switch port without any SPI
+ * traffic.
+ *
+ * Example:
+ *
+ *     uint8_t switch_bits = pifacecad_sampler_switches();
+ *
+ */
+uint8_t pifacecad_sampler_switches(void);
+
+/**
+ * Copies up to max samples, starting at the sequence number in cursor,
+ * into samples and advances cursor. Samples which have already been
+ * overwritten are skipped. Returns the number of samples copied.
+ *
+ * Example (print every change since the last call):
+ *
+ *     static uint64_t cursor = 0;
+ *     struct pifacecad_switch_sample samples[16];
+ *     size_t i, n = pifacecad_sampler_read(&cursor, samples, 16);
+ *     for (i = 0; i < n; i++) {
+ *         printf("%llu %02x\n", samples[i].timestamp_ns, samples[i].switches);
+ *     }
+ *
+ */
+size_t pifacecad_sampler_read(uint64_t * cursor,
+                              struct pifacecad_switch_sample * samples,
+                              size_t max);
+
+/**
+ * Returns an eventfd (non-blocking) which becomes readable whenever the
+ * sampler records a change. Read it to reset it, then use
+ * pifacecad_sampler_read.
+ *
+ * Example:
+ *
+ *     struct epoll_event event = {.events = EPOLLIN};
+ *     int switch_fd = pifacecad_sampler_event_fd();
+ *     epoll_ctl(epoll_fd, EPOLL_CTL_ADD, switch_fd, &event);
+ *
+ */
+int pifacecad_sampler_event_fd(void);
+
+/**
+ * Returns the sequence number of the next sample to be recorded. Use it
+ * as a cursor to only read samples from now on.
+ *
+ * Example:
+ *
+ *     uint64_t cursor = pifacecad_sampler_head();
+ *
+ */
+uint64_t pifacecad_sampler_head(void);
+
+/**
+ * Publishes the switches as a virtual keyboard (through /dev/uinput)
+ * called name (NULL for PIFACECAD_UINPUT_NAME). keymap gives the Linux
+ * key code (KEY_* from linux/input.h, 0 for none) sent by each switch,
+ * NULL for 1-5, enter, left and right. The switches are watched by the
+ * sampler, started at rate_hz unless it is already running, so any
+ * number of evdev readers cost no more SPI traffic than one. Returns the
+ * uinput file descriptor or -1 on error (errno EBUSY if it is already
+ * started or a group is open).
+ *
+ * Example:
+ *
+ *     const uint16_t keys[PIFACECAD_NUM_SWITCHES] = {
+ *         KEY_PLAYPAUSE, KEY_STOPCD, KEY_PREVIOUSSONG, KEY_NEXTSONG,
+ *         KEY_MUTE, KEY_ENTER, KEY_VOLUMEDOWN, KEY_VOLUMEUP,
+ *     };
+ *     pifacecad_uinput_start(NULL, keys, 200);
+ *
+ */
+int pifacecad_uinput_start(const char * name,
+                           const uint16_t * keymap,
+                           unsigned int rate_hz);
+
+/**
+ * Removes the virtual keyboard (and stops the sampler, if
+ * pifacecad_uinput_start started it).
+ *
+ * Example:
+ *
+ *     pifacecad_uinput_stop();
+ *
+ */
+void pifacecad_uinput_stop(void);
+
+/**
+ * Switch to screen latency distribution (see pifacecad_latency_start).
+ */
+struct pifacecad_latency_stats {
+    unsigned long count; // number of measurements
+    uint64_t min_ns, max_ns, mean_ns;
+    uint64_t p50_ns, p90_ns, p99_ns; // of the most recent measurements
+    // histogram[i] counts latencies of 2^i to 2^(i+1) microseconds
+    unsigned long histogram[PIFACECAD_LATENCY_BUCKETS];
+};
+
+/**
+ * Prepares the priority scheduled LCD updates (pifacecad_sched_*),
+ * starting a worker thread unless pifacecad_rt_start already has.
+ * Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_sched_open();
+ *
+ */
+int pifacecad_sched_open(void);
+
+/**
+ * Waits for the queued updates to be sent, then stops the worker if
+ * pifacecad_sched_open started it and nothing else is using it.
+ *
+ * Example:
+ *
+ *     pifacecad_sched_close();
+ *
+ */
+void pifacecad_sched_close(void);
+
+/**
+ * Queues len bytes of message for (col, row) onwards at priority
+ * (PIFACECAD_PRIORITY_*) and returns straight away. Updates are sent a
+ * few cells at a time, highest priority first, and anything still queued
+ * for the same cells at the same or a lower priority is dropped. Returns
+ * 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_sched_write(0, 0, log_line, 40, PIFACECAD_PRIORITY_LOW);
+ *     pifacecad_sched_write(0, 1, "FIRE ALARM", 10,
+ *                           PIFACECAD_PRIORITY_URGENT); // goes next
+ *
+ */
+int pifacecad_sched_write(uint8_t col,
+                          uint8_t row,
+                          const char * message,
+                          size_t len,
+                          int priority);
+
+/**
+ * Queues a custom bitmap upload at priority, sent half a bitmap at a
+ * time ahead of characters of the same priority. Returns 0 on success,
+ * -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_sched_store_custom_bitmap(0, bell, PIFACECAD_PRIORITY_HIGH);
+ *
+ */
+int pifacecad_sched_store_custom_bitmap(uint8_t location,
+                                        const uint8_t bitmap[],
+                                        int priority);
+
+/**
+ * Returns the number of cells and half bitmaps still queued.
+ *
+ * Example:
+ *
+ *     int backlog = pifacecad_sched_pending();
+ *
+ */
+int pifacecad_sched_pending(void);
+
+/**
+ * Waits until every queued update has been sent.
+ *
+ * Example:
+ *
+ *     pifacecad_sched_wait();
+ *
+ */
+void pifacecad_sched_wait(void);
+
+/**
+ * Clears virtual screen (0 to PIFACECAD_MAX_SCREENS - 1): spaces, no
+ * custom bitmaps, cursor at home and just the display on (no cursor or
+ * blink). Screens can be drawn at any time, whichever one is showing.
+ * Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_screen_clear(PAGE_ALARMS);
+ *
+ */
+int pifacecad_screen_clear(int screen);
+
+/**
+ * Writes len bytes of message to screen from (col, row), as
+ * pifacecad_lcd_write_n would. If the screen is showing only the cells
+ * which changed are sent to the LCD. Returns the cursor address after the
+ * message or -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_screen_write(PAGE_NETWORK, 0, 0, "eth0 up", 7);
+ *
+ */
+int pifacecad_screen_write(int screen,
+                           uint8_t col,
+                           uint8_t row,
+                           const char * message,
+                           size_t len);
+
+/**
+ * Stores a custom bitmap in one of the screen's eight locations. It is
+ * only sent to the LCD when the screen is shown, if it differs from what
+ * the LCD holds. Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     uint8_t bell[] = {0x04, 0x0e, 0x0e, 0x0e, 0x1f, 0x00, 0x04, 0x00};
+ *     pifacecad_screen_store_custom_bitmap(PAGE_ALARMS, 0, bell);
+ *
+ */
+int pifacecad_screen_store_custom_bitmap(int screen,
+                                         uint8_t location,
+                                         const uint8_t bitmap[]);
+
+/**
+ * Sets where the screen's cursor is and whether the display, cursor and
+ * blink are on (LCD_DISPLAYON, LCD_CURSORON, LCD_BLINKON). Returns 0 on
+ * success, -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_screen_set_cursor(PAGE_SETUP, 4, 1, LCD_DISPLAYON | \
+ *                                                   LCD_CURSORON);
+ *
+ */
+int pifacecad_screen_set_cursor(int screen,
+                                uint8_t col,
+                                uint8_t row,
+                                uint8_t display_control);
+
+/**
+ * Shows screen on the LCD, sending only what differs from what is on it:
+ * changed custom bitmaps, changed runs of characters (as one batch), the
+ * display control and the cursor. Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     if (pressed(NEXT)) {
+ *         page = (page + 1) % NUM_PAGES;
+ *         pifacecad_screen_show(page);
+ *     }
+ *
+ */
+int pifacecad_screen_show(int screen);
+
+/**
+ * Returns the screen which is showing, or -1 if none.
+ *
+ * Example:
+ *
+ *     int page = pifacecad_screen_showing();
+ *
+ */
+int pifacecad_screen_showing(void);
+
+/**
+ * Starts paging: returns the display home and takes over DDRAM columns
+ * 0 to 2 * PIFACECAD_PAGER_WIDTH - 1. Only one of the two halves is
+ * visible at a time, the other is where the next page goes. Autoscroll
+ * should be off. Returns 0.
+ *
+ * Example:
+ *
+ *     pifacecad_pager_open();
+ *
+ */
+int pifacecad_pager_open(void);
+
+/**
+ * Stops paging and returns the display home.
+ *
+ * Example:
+ *
+ *     pifacecad_pager_close();
+ *
+ */
+void pifacecad_pager_close(void);
+
+/**
+ * Writes the next page (up to two rows of PIFACECAD_PAGER_WIDTH
+ * characters, split at '\n', padded with spaces) into the half of DDRAM
+ * which isn't showing. Nothing visible changes. If the priority scheduler
+ * is open (pifacecad_sched_open) the page is queued behind everything
+ * else at PIFACECAD_PRIORITY_LOW and sent in the background, otherwise it
+ * is sent straight away. Returns 0, or -1 if the pager isn't open.
+ *
+ * Example:
+ *
+ *     pifacecad_pager_prefetch(next, strlen(next));
+ *
+ */
+int pifacecad_pager_prefetch(const char * page, size_t len);
+
+/**
+ * Shows the page written by pifacecad_pager_prefetch. The characters are
+ * already in DDRAM, so only display shift commands (or a single return
+ * home) are sent and the whole page changes at once. Returns 0, or -1
+ * (errno EAGAIN) if no page has been prefetched since the last flip.
+ *
+ * Example:
+ *
+ *     pifacecad_pager_open();
+ *     pifacecad_pager_prefetch(pages[0], strlen(pages[0]));
+ *     for (i = 0; i < num_pages; i++) {
+ *         pifacecad_pager_flip();
+ *         if (i + 1 < num_pages) {
+ *             pifacecad_pager_prefetch(pages[i + 1], strlen(pages[i + 1]));
+ *         }
+ *         sleep(5);
+ *     }
+ *     pifacecad_pager_close();
+ *
+ */
+int pifacecad_pager_flip(void);
+
+/**
+ * Starts (or restarts) measuring the time from each switch edge, seen by
+ * pifacecad_read_switches or the switch sampler, to the last enable
+ * pulse of the first LCD operation after it which changes the screen.
+ *
+ * Example:
+ *
+ *     pifacecad_latency_start();
+ *
+ */
+void pifacecad_latency_start(void);
+
+/**
+ * Stops measuring. The measurements so far are kept.
+ *
+ * Example:
+ *
+ *     pifacecad_latency_stop();
+ *
+ */
+void pifacecad_latency_stop(void);
+
+/**
+ * Copies the latency distribution measured so far into stats.
+ *
+ * Example:
+ *
+ *     struct pifacecad_latency_stats stats;
+ *     pifacecad_latency_stats(&stats);
+ *     printf("p99 %llu us\n", stats.p99_ns / 1000);
+ *
+ */
+void pifacecad_latency_stats(struct pifacecad_latency_stats * stats);
+
+/**
+ * Replaces the board with a simulation (no SPI) until
+ * pifacecad_sim_close. Call before pifacecad_open. The switches are
+ * driven by script (NULL for none), a file of edges in time order, one
+ * per line: milliseconds after opening, switch number and "press" or
+ * "release". Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     // 100 0 press
+ *     // 250 0 release
+ *     pifacecad_sim_open("presses.txt");
+ *     pifacecad_open();
+ *
+ */
+int pifacecad_sim_open(const char * script);
+
+/**
+ * Stops simulating the board.
+ *
+ * Example:
+ *
+ *     pifacecad_sim_close();
+ *
+ */
+void pifacecad_sim_close(void);
+
 /**
- * Opens and initialises a PiFace Control and Display.
- * Returns a file descriptor for making raw SPI transactions to the
- * MCP23S17 (for advanced users only).
+ * Returns 1 once every edge in the simulation script has happened.
  *
  * Example:
  *
- *     pifacecad_open();
- *     int pifacedigital_fd = pifacecad_open(); // advanced
+ *     while (!pifacecad_sim_done()) {
+ *         poll_switches();
+ *     }
  *
  */
-int pifacecad_open(void);
+int pifacecad_sim_done(void);
 
 /**
- * Opens a PiFace Control and Display without initialising it.
- * Returns a file descriptor for making raw SPI transactions to the
- * MCP23S17 (for advanced users only).
+ * Presses (pressed = 1) or releases a simulated switch now.
  *
  * Example:
  *
- *     pifacecad_open_noinit();
- *     int pifacedigital_fd = pifacecad_open_noinit(); // advanced
+ *     pifacecad_sim_set_switch(3, 1);
  *
  */
-int pifacecad_open_noinit(void);
+void pifacecad_sim_set_switch(uint8_t switch_num, uint8_t pressed);
 
 /**
- * Closes a PiFace Control and Display (turns off interrupts, closes file
- * descriptor).
+ * Writes a message to the LCD screen starting from the current cursor
+ * position. Accepts '\\n'. Returns the current cursor address.
  *
  * Example:
  *
- *     pifacecad_close();
+ *     pifacecad_lcd_write("Hello, World!");
+ *     pifacecad_lcd_write("Moving to a\nnew line is easy");
+ *     uint8_t address = pifacecad_lcd_write("Cursor moves after\nwriting");
  *
  */
-void pifacecad_close(void);
+uint8_t pifacecad_lcd_write(const char * message);
 
 /**
- * Initialised the LCD. You will not need to call this if you have called
- * pifacecad_open.
+ * Writes len bytes of message (which need not be NUL terminated) to the
+ * LCD screen starting from the current cursor position, as one batch of
+ * SPI transfers. Accepts '\\n'. Returns the current cursor address.
  *
  * Example:
  *
- *     pifacecad_lcd_init();
+ *     const char * words = "Hello, World!";
+ *     pifacecad_lcd_write_n(words, 5); // Hello
  *
  */
-void pifacecad_lcd_init(void);
+uint8_t pifacecad_lcd_write_n(const char * message, size_t len);
+
+// pifacecad_lcd_segment col: carry on from where the last one finished
+#define PIFACECAD_LCD_HERE 0xff
 
 /**
- * Reads the entire switch port.
+ * A piece of text for pifacecad_lcd_writev, written from (col, row), or
+ * from the current cursor position if col is PIFACECAD_LCD_HERE.
+ */
+struct pifacecad_lcd_segment {
+    uint8_t col;
+    uint8_t row;
+    const char * buf; // need not be NUL terminated
+    size_t len;
+};
+
+/**
+ * Writes num segments of text, each at its own position, as one batch of
+ * SPI transfers without copying them together first. Accepts '\\n'.
+ * Returns the cursor address after the last segment.
  *
  * Example:
  *
- *     uint8_t switch_bits = pifacecad_read_switches();
+ *     char value[8];
+ *     int len = snprintf(value, sizeof(value), "%.1f", temperature);
+ *     const struct pifacecad_lcd_segment screen[] = {
+ *         {0, 0, "Temp:", 5},
+ *         {6, 0, value, len},
+ *         {PIFACECAD_LCD_HERE, 0, "C", 1},
+ *     };
+ *     pifacecad_lcd_writev(screen, 3);
  *
  */
-uint8_t pifacecad_read_switches(void);
+uint8_t pifacecad_lcd_writev(const struct pifacecad_lcd_segment * segments,
+                             int num);
 
 /**
- * Reads a single switch.
+ * Prepares the non-blocking LCD functions (pifacecad_lcd_*_async),
+ * starting a worker thread unless pifacecad_rt_start already has.
+ * Returns an eventfd (non-blocking) which becomes readable when requests
+ * complete, or -1 on error.
  *
- * Example (read switch 3):
+ * Example:
  *
- *     uint8_t switch_value = pifacecad_read_switch(3);
+ *     int lcd_fd = pifacecad_async_open();
+ *     struct epoll_event event = {.events = EPOLLIN};
+ *     epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lcd_fd, &event);
  *
  */
-uint8_t pifacecad_read_switch(uint8_t switch_num);
+int pifacecad_async_open(void);
 
 /**
- * Writes a message to the LCD screen starting from the current cursor
- * position. Accepts '\\n'. Returns the current cursor address.
+ * Waits for outstanding requests to finish and closes the completion
+ * eventfd. Stops the worker if pifacecad_async_open started it and
+ * nothing else is using it.
  *
  * Example:
  *
- *     pifacecad_lcd_write("Hello, World!");
- *     pifacecad_lcd_write("Moving to a\nnew line is easy");
- *     uint8_t address = pifacecad_lcd_write("Cursor moves after\nwriting");
+ *     pifacecad_async_close();
  *
  */
-uint8_t pifacecad_lcd_write(const char * message);
+void pifacecad_async_close(void);
+
+/**
+ * Returns the completion eventfd (-1 if not open).
+ *
+ * Example:
+ *
+ *     int lcd_fd = pifacecad_async_fd();
+ *
+ */
+int pifacecad_async_fd(void);
+
+/**
+ * Copies up to max tokens of completed requests into tokens and returns
+ * how many there were. Call when the completion eventfd is readable.
+ *
+ * Example:
+ *
+ *     uint32_t done[PIFACECAD_ASYNC_QUEUE_LEN];
+ *     int i, n = pifacecad_async_reap(done, PIFACECAD_ASYNC_QUEUE_LEN);
+ *
+ */
+int pifacecad_async_reap(uint32_t * tokens, int max);
+
+/**
+ * Queues pifacecad_lcd_write(message) and returns straight away with a
+ * request token, or 0 on error (errno EAGAIN when PIFACECAD_ASYNC_QUEUE_LEN
+ * requests are in flight or not yet reaped, EMSGSIZE for more than
+ * PIFACECAD_ASYNC_MAX_WRITE chars).
+ *
+ * Example:
+ *
+ *     uint32_t token = pifacecad_lcd_write_async("Hello, World!");
+ *
+ */
+uint32_t pifacecad_lcd_write_async(const char * message);
+
+/**
+ * Queues pifacecad_lcd_clear. Returns a request token, 0 on error.
+ *
+ * Example:
+ *
+ *     uint32_t token = pifacecad_lcd_clear_async();
+ *
+ */
+uint32_t pifacecad_lcd_clear_async(void);
+
+/**
+ * Queues pifacecad_lcd_set_cursor. Returns a request token, 0 on error.
+ *
+ * Example:
+ *
+ *     uint32_t token = pifacecad_lcd_set_cursor_async(5, 1);
+ *
+ */
+uint32_t pifacecad_lcd_set_cursor_async(uint8_t col, uint8_t row);
+
+/**
+ * Queues pifacecad_lcd_store_custom_bitmap (the bitmap is copied).
+ * Returns a request token, 0 on error.
+ *
+ * Example:
+ *
+ *     uint8_t bitmap[] = {0x15, 0xa, 0x15, 0xa, 0x15, 0xa, 0x15, 0xa};
+ *     uint32_t token = pifacecad_lcd_store_custom_bitmap_async(0, bitmap);
+ *
+ */
+uint32_t pifacecad_lcd_store_custom_bitmap_async(uint8_t location,
+                                                 const uint8_t bitmap[]);
 
 /**
  * Sets the cursor position on the screen (col , row).
@@ -301,6 +1108,60 @@ void pifacecad_lcd_backlight_on(void);
  */
 void pifacecad_lcd_backlight_off(void);
 
+/**
+ * Dims the backlight by switching it on for duty / 255 of every period
+ * from a timer thread. LCD transfers carry the level themselves, so the
+ * thread only writes the edges which no LCD transfer has. freq_hz (0 for
+ * PIFACECAD_PWM_HZ) is lowered if need be to keep the edges within
+ * max_bytes_per_sec of SPI traffic (0 for
+ * PIFACECAD_PWM_MAX_BYTES_PER_SEC). pifacecad_lcd_backlight_on/off only
+ * last until the next edge while it is running. Returns 0 on success, -1
+ * on error.
+ *
+ * Example:
+ *
+ *     pifacecad_backlight_pwm_start(64, 0, 0); // a quarter, 200Hz
+ *
+ */
+int pifacecad_backlight_pwm_start(uint8_t duty,
+                                  unsigned int freq_hz,
+                                  unsigned int max_bytes_per_sec);
+
+/**
+ * Changes the duty cycle (0 off, 255 fully on) straight away, even from
+ * fully off or on. Returns 0, or -1 if PWM isn't running.
+ *
+ * Example:
+ *
+ *     pifacecad_backlight_pwm_set(night ? 16 : 255);
+ *
+ */
+int pifacecad_backlight_pwm_set(uint8_t duty);
+
+/**
+ * Stops dimming, leaving the backlight on (off if the duty cycle was 0).
+ * pifacecad_close stops it too.
+ *
+ * Example:
+ *
+ *     pifacecad_backlight_pwm_stop();
+ *
+ */
+void pifacecad_backlight_pwm_stop(void);
+
+/**
+ * Counts, since pifacecad_backlight_pwm_start, the backlight edges the
+ * PWM thread wrote itself and those LCD transfers had already written.
+ *
+ * Example:
+ *
+ *     unsigned long edges, merged;
+ *     pifacecad_backlight_pwm_stats(&edges, &merged);
+ *
+ */
+void pifacecad_backlight_pwm_stats(unsigned long * edges,
+                                   unsigned long * merged);
+
 /**
  * Moves the display left.
  *
@@ -386,6 +1247,146 @@ void pifacecad_lcd_write_custom_bitmap(uint8_t location);
  */
 void pifacecad_lcd_store_custom_bitmap(uint8_t location, uint8_t bitmap[]);
 
+/**
+ * A bar graph drawn with custom bitmaps (see pifacecad_bargraph_init).
+ */
+struct pifacecad_bargraph {
+    uint8_t col, row; // left cell (horizontal) or bottom cell (vertical)
+    uint8_t cells; // length of the bar in characters
+    uint8_t orientation; // PIFACECAD_BAR_HORIZONTAL or PIFACECAD_BAR_VERTICAL
+    uint8_t first_slot; // first custom bitmap location used by the bar
+    unsigned int level; // currently drawn level, in pixel steps
+};
+
+/**
+ * Sets up a bar graph of cells characters starting at (col, row) and
+ * draws it empty. Horizontal bars grow to the right with 5 steps per
+ * character and use 4 custom bitmap locations from first_slot. Vertical
+ * bars grow up from row with 8 steps per character and use 7 locations.
+ * The bitmaps are only stored if the LCD doesn't already hold them, so
+ * bars with the same orientation and first_slot share them. The bar is
+ * cut short at the end of display RAM (col 39, or row 0 going up).
+ * Returns 0 on success, -1 (errno EINVAL) if (col, row) is outside
+ * display RAM.
+ *
+ * Example (a 16 character progress bar on the bottom row):
+ *
+ *     struct pifacecad_bargraph bar;
+ *     pifacecad_bargraph_init(&bar, 0, 1, 16, PIFACECAD_BAR_HORIZONTAL, 0);
+ *
+ */
+int pifacecad_bargraph_init(struct pifacecad_bargraph * bar,
+                            uint8_t col,
+                            uint8_t row,
+                            uint8_t cells,
+                            uint8_t orientation,
+                            uint8_t first_slot);
+
+/**
+ * Draws value out of max (max = 0 means out of the bar's resolution).
+ * Only the characters at the end of the bar which change are rewritten.
+ *
+ * Example:
+ *
+ *     pifacecad_bargraph_set(&bar, 42, 100); // 42%
+ *
+ */
+void pifacecad_bargraph_set(struct pifacecad_bargraph * bar,
+                            unsigned int value,
+                            unsigned int max);
+
+/**
+ * Returns the number of steps the bar can show.
+ *
+ * Example:
+ *
+ *     unsigned int steps = pifacecad_bargraph_resolution(&bar); // 80
+ *
+ */
+unsigned int pifacecad_bargraph_resolution(
+    const struct pifacecad_bargraph * bar);
+
+/**
+ * An animation of custom bitmap frames (see pifacecad_sprite_add).
+ */
+struct pifacecad_sprite {
+    uint8_t location; // custom bitmap location the sprite animates
+    const uint8_t (*frames)[8]; // num_frames 5x8 bitmaps
+    int num_frames;
+    int frame; // frame currently shown
+    uint64_t interval_ns; // time between frames
+    uint64_t next_ns; // CLOCK_MONOTONIC time of the next frame
+};
+
+/**
+ * Binds an animation to a custom bitmap location (0-7) and stores its
+ * first frame. Write the location with pifacecad_lcd_write_custom_bitmap
+ * wherever the sprite should appear; every copy animates together. The
+ * frames are not copied and must stay valid until the sprite is removed.
+ * Returns 0 on success, -1 on error.
+ *
+ * Example (a two frame blinking dot):
+ *
+ *     static const uint8_t blink[2][8] = {
+ *         {0x00, 0x00, 0x0e, 0x0e, 0x0e, 0x00, 0x00, 0x00},
+ *         {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+ *     };
+ *     static struct pifacecad_sprite dot;
+ *     pifacecad_sprite_add(&dot, 0, blink, 2, 500);
+ *     pifacecad_lcd_write_custom_bitmap(0);
+ *     pifacecad_sprite_start();
+ *
+ */
+int pifacecad_sprite_add(struct pifacecad_sprite * sprite,
+                         uint8_t location,
+                         const uint8_t (*frames)[8],
+                         int num_frames,
+                         unsigned int interval_ms);
+
+/**
+ * Stops animating a sprite. The location keeps its current frame.
+ *
+ * Example:
+ *
+ *     pifacecad_sprite_remove(&dot);
+ *
+ */
+void pifacecad_sprite_remove(struct pifacecad_sprite * sprite);
+
+/**
+ * Moves every sprite which is due on to its next frame, sending only the
+ * bitmap rows which change. Returns the CLOCK_MONOTONIC time (ns) the
+ * next sprite is due. Use this to drive sprites from your own loop
+ * instead of pifacecad_sprite_start.
+ *
+ * Example:
+ *
+ *     uint64_t next_ns = pifacecad_sprite_tick();
+ *
+ */
+uint64_t pifacecad_sprite_tick(void);
+
+/**
+ * Starts a timer thread which calls pifacecad_sprite_tick whenever a
+ * sprite is due. Returns 0 on success, -1 on error.
+ *
+ * Example:
+ *
+ *     pifacecad_sprite_start();
+ *
+ */
+int pifacecad_sprite_start(void);
+
+/**
+ * Stops the sprite timer thread.
+ *
+ * Example:
+ *
+ *     pifacecad_sprite_stop();
+ *
+ */
+void pifacecad_sprite_stop(void);
+
 /**
  * Send a command to the HD44780.
  *
@@ -466,6 +1467,178 @@ void pifacecad_lcd_set_backlight(uint8_t state);
  */
 void pifacecad_lcd_pulse_enable(void);
 
+/**
+ * Real-time worker settings (see pifacecad_rt_start).
+ */
+struct pifacecad_rt_config {
+    int priority; // SCHED_FIFO priority 1-99, 0 to keep the default policy
+    int cpu; // core to pin the worker to, -1 for any
+    int lock_memory; // mlockall the process
+    long deadline_ns; // max submit to completion time, 0 for no deadline
+    size_t stack_prefault; // bytes of worker stack to pre-fault (0: 64KiB)
+};
+
+/**
+ * Starts the real-time worker thread. Until pifacecad_rt_stop, the
+ * pifacecad_lcd_* and switch functions, and work passed to
+ * pifacecad_rt_call, run on this thread with the given SCHED_FIFO
+ * priority, pinned to the given core and with memory locked and
+ * pre-faulted (no more than the thread's stack). The screen, pager,
+ * widget and sprite functions run on the calling thread, so pass them
+ * to pifacecad_rt_call to have them run on the worker too. Returns 0 on
+ * success, -1 on error (errno is EPERM without CAP_SYS_NICE, EINVAL for
+ * a bad priority or core).
+ *
+ * Example:
+ *
+ *     struct pifacecad_rt_config config = {
+ *         .priority = 50, .cpu = 3, .lock_memory = 1, .deadline_ns = 5000000,
+ *     };
+ *     pifacecad_rt_start(&config);
+ *
+ */
+int pifacecad_rt_start(const struct pifacecad_rt_config * config);
+
+/**
+ * Finishes any queued work and stops the real-time worker thread.
+ *
+ * Example:
+ *
+ *     pifacecad_rt_stop();
+ *
+ */
+void pifacecad_rt_stop(void);
+
+/**
+ * Runs func(arg) on the real-time worker and waits for it to finish.
+ * Runs it directly if the worker is not started.
+ *
+ * Example:
+ *
+ *     void update_screen(void * arg)
+ *     {
+ *         pifacecad_lcd_set_cursor(0, 0);
+ *         pifacecad_lcd_write((char *) arg);
+ *     }
+ *     pifacecad_rt_call(update_screen, "Hello, World!");
+ *
+ */
+int pifacecad_rt_call(void (*func)(void *), void * arg);
+
+/**
+ * Returns the number of pifacecad_rt_call jobs which took longer than
+ * the configured deadline_ns from submission to completion.
+ *
+ * Example:
+ *
+ *     unsigned long missed = pifacecad_rt_missed_deadlines();
+ *
+ */
+unsigned long pifacecad_rt_missed_deadlines(void);
+
+/**
+ * Returns the worst submission to completion time seen (nanoseconds).
+ *
+ * Example:
+ *
+ *     long worst_ns = pifacecad_rt_worst_latency_ns();
+ *
+ */
+long pifacecad_rt_worst_latency_ns(void);
+
+/**
+ * Checks that the HD44780 is still in step with the library by reading
+ * back its address counter (through the RW pin) and comparing it with the
+ * address the library expects. If they differ, for example because a
+ * process was killed half way through sending a byte, the display is
+ * resynchronised with pifacecad_lcd_resync. Returns 0 if in step, 1 if it
+ * had to resynchronise, -1 if the LCD has not been initialised or can't
+ * be read back (errno EAGAIN until pifacecad_lcd_init or
+ * pifacecad_lcd_reload has set up the state to compare against, EBUSY
+ * while a group is open, ENOTSUP on a simulated board).
+ *
+ * Example:
+ *
+ *     if (pifacecad_lcd_check() > 0) {
+ *         printf("LCD was out of step\n");
+ *     }
+ *
+ */
+int pifacecad_lcd_check(void);
+
+/**
+ * Puts the HD44780 back into 4-bit mode from whichever nibble it was
+ * waiting for and re-sends the control state, the custom bitmaps and the
+ * screen contents remembered by the library. Much quicker than
+ * pifacecad_lcd_init and nothing on the screen is lost.
+ *
+ * Example:
+ *
+ *     pifacecad_lcd_resync();
+ *
+ */
+void pifacecad_lcd_resync(void);
+
+/**
+ * Reads the HD44780's address counter through the RW pin. Returns the
+ * address, or -1 if the controller can't be read back: errno is EBUSY
+ * while a group is open, ENOTSUP on a simulated board and ETIMEDOUT if
+ * the controller stays busy.
+ *
+ * Example:
+ *
+ *     int address = pifacecad_lcd_read_address();
+ *
+ */
+int pifacecad_lcd_read_address(void);
+
+/**
+ * Reads all 80 characters of display RAM from the HD44780 into ddram,
+ * laid out col + row * 40. The address counter is put back afterwards.
+ * Returns 0, or -1 as pifacecad_lcd_read_address.
+ *
+ * Example:
+ *
+ *     uint8_t ddram[LCD_RAM_WIDTH];
+ *     pifacecad_lcd_read_ddram(ddram);
+ *     printf("%.16s\n%.16s\n", ddram, ddram + LCD_RAM_WIDTH / 2);
+ *
+ */
+int pifacecad_lcd_read_ddram(uint8_t ddram[]);
+
+/**
+ * Reads the eight custom bitmaps (64 rows, location * 8 + row) from the
+ * HD44780. Only the low five bits of each row are kept. Returns 0, or -1
+ * as pifacecad_lcd_read_address.
+ *
+ * Example:
+ *
+ *     uint8_t cgram[64];
+ *     pifacecad_lcd_read_cgram(cgram);
+ *
+ */
+int pifacecad_lcd_read_cgram(uint8_t cgram[]);
+
+/**
+ * Replaces the library's copy of the display contents (characters,
+ * custom bitmaps and cursor address) with what the HD44780 actually
+ * holds, so that a process which attaches to a running display with
+ * pifacecad_open_noinit can carry on updating it without a clear.
+ * Settings which can't be read back (entry mode, display control and
+ * display shift) are kept if this process already knew them, otherwise
+ * they are set as pifacecad_lcd_init leaves them. Returns 0, or -1 as
+ * pifacecad_lcd_read_address.
+ *
+ * Example:
+ *
+ *     pifacecad_open_noinit();
+ *     if (pifacecad_lcd_reload() < 0) {
+ *         pifacecad_lcd_init();
+ *     }
+ *
+ */
+int pifacecad_lcd_reload(void);
+
 /**
  * Returns an address calculated from a column and a row.
  *
@@ -0,0 +1,337 @@
+/**
+ * @file  pifacecad.hpp
+ * @brief Header only C++17 interface to libpifacecad.
+ *
+ * Wraps the pifacecad_* functions in a move-only RAII object which opens
+ * the board when it is constructed and closes it when it is destroyed.
+ * HD44780 commands and DDRAM addresses can be worked out at compile time.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PIFACECAD_HPP
+#define _PIFACECAD_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include "pifacecad.h"
+
+namespace pifacecad {
+
+/**
+ * HD44780 command encoders. Every argument is optional, the defaults
+ * match what pifacecad_open sets up.
+ *
+ * Example:
+ *
+ *     constexpr uint8_t display = cmd::display_control(true, false, false);
+ *     static_assert(display == (LCD_DISPLAYCONTROL | LCD_DISPLAYON));
+ *     lcd.command(display);
+ *
+ */
+namespace cmd {
+
+constexpr uint8_t clear_display()
+{
+    return LCD_CLEARDISPLAY;
+}
+
+constexpr uint8_t return_home()
+{
+    return LCD_RETURNHOME;
+}
+
+constexpr uint8_t entry_mode(bool left_to_right = true, bool shift = false)
+{
+    return LCD_ENTRYMODESET | \
+           (left_to_right ? LCD_ENTRYLEFT : LCD_ENTRYRIGHT) | \
+           (shift ? LCD_ENTRYSHIFTINCREMENT : LCD_ENTRYSHIFTDECREMENT);
+}
+
+constexpr uint8_t display_control(bool display = true,
+                                  bool cursor = true,
+                                  bool blink = true)
+{
+    return LCD_DISPLAYCONTROL | \
+           (display ? LCD_DISPLAYON : LCD_DISPLAYOFF) | \
+           (cursor ? LCD_CURSORON : LCD_CURSOROFF) | \
+           (blink ? LCD_BLINKON : LCD_BLINKOFF);
+}
+
+constexpr uint8_t cursor_shift(bool move_display = false, bool right = true)
+{
+    return LCD_CURSORSHIFT | \
+           (move_display ? LCD_DISPLAYMOVE : LCD_CURSORMOVE) | \
+           (right ? LCD_MOVERIGHT : LCD_MOVELEFT);
+}
+
+constexpr uint8_t function_set(bool eight_bit = false,
+                               bool two_line = true,
+                               bool five_by_ten = false)
+{
+    return LCD_FUNCTIONSET | \
+           (eight_bit ? LCD_8BITMODE : LCD_4BITMODE) | \
+           (two_line ? LCD_2LINE : LCD_1LINE) | \
+           (five_by_ten ? LCD_5X10DOTS : LCD_5X8DOTS);
+}
+
+/* row (0-7) of custom bitmap location (0-7) */
+constexpr uint8_t set_cgram_address(uint8_t location, uint8_t row = 0)
+{
+    return LCD_SETCGRAMADDR | ((location & 0x7) << 3) | (row & 0x7);
+}
+
+constexpr uint8_t set_ddram_address(uint8_t address)
+{
+    return LCD_SETDDRAMADDR | (address & 0x7f);
+}
+
+} // namespace cmd
+
+/**
+ * Display geometry. The HD44780 starts each row at a multiple of 0x40
+ * and holds RamWidth / Rows characters per row, Cols of which are
+ * visible at once.
+ *
+ * Example:
+ *
+ *     using Cad = Geometry<16, 2>;
+ *     static_assert(Cad::address<3, 1>() == 0x43);
+ *     uint8_t row = Cad::row(address);
+ *
+ */
+template <uint8_t Cols, uint8_t Rows, uint8_t RamWidth = LCD_RAM_WIDTH>
+struct Geometry {
+    static_assert(Rows >= 1 && Rows <= 2, "HD44780 has one or two rows");
+    static_assert(RamWidth % Rows == 0, "rows must split the RAM evenly");
+    static_assert(Cols <= RamWidth / Rows, "more columns than RAM");
+
+    static constexpr uint8_t cols = Cols;
+    static constexpr uint8_t rows = Rows;
+    static constexpr uint8_t row_width = RamWidth / Rows;
+    static constexpr uint8_t row_offset = 0x40;
+
+    static constexpr uint8_t address(uint8_t col, uint8_t row)
+    {
+        return col + row * row_offset;
+    }
+
+    template <uint8_t Col, uint8_t Row>
+    static constexpr uint8_t address()
+    {
+        static_assert(Col < row_width, "column is off the end of the row");
+        static_assert(Row < Rows, "row is off the bottom of the display");
+        return address(Col, Row);
+    }
+
+    static constexpr uint8_t col(uint8_t address)
+    {
+        return address % row_offset;
+    }
+
+    static constexpr uint8_t row(uint8_t address)
+    {
+        return address >= row_offset ? 1 : 0;
+    }
+};
+
+// PiFace Control and Display
+using Cad16x2 = Geometry<LCD_WIDTH, LCD_MAX_LINES>;
+
+static_assert(Cad16x2::address<0, 1>() == 0x40);
+static_assert(Cad16x2::row_width == LCD_RAM_WIDTH / LCD_MAX_LINES);
+
+namespace detail {
+// one board whatever the geometry, the C library state is global
+inline std::atomic<bool> board_open(false);
+} // namespace detail
+
+/**
+ * Opens and initialises the board on construction, closes it on
+ * destruction. The library drives a single board, so only one can be
+ * open at a time: constructing a second throws std::logic_error, a
+ * failure to open throws std::system_error. Movable, not copyable.
+ *
+ * Example:
+ *
+ *     pifacecad::Lcd lcd;
+ *     lcd.backlight(true);
+ *     lcd.set_cursor<0, 1>();
+ *     std::string_view word = "Hello, World!";
+ *     lcd.write(word.substr(0, 5));
+ *
+ */
+template <typename G = Cad16x2>
+class BasicBoard {
+public:
+    using geometry = G;
+
+    explicit BasicBoard(bool init = true)
+    {
+        if (open_flag().exchange(true)) {
+            throw std::logic_error("pifacecad: board is already open");
+        }
+        const int fd = init ? pifacecad_open() : pifacecad_open_noinit();
+        if (fd < 0) {
+            const int error = errno;
+            open_flag() = false;
+            throw std::system_error(error, std::generic_category(),
+                                    "pifacecad: could not open board");
+        }
+        fd_ = fd;
+    }
+
+    ~BasicBoard()
+    {
+        if (fd_ >= 0) {
+            pifacecad_close();
+            open_flag() = false;
+        }
+    }
+
+    BasicBoard(const BasicBoard &) = delete;
+    BasicBoard & operator=(const BasicBoard &) = delete;
+
+    BasicBoard(BasicBoard && other) noexcept : fd_(other.fd_)
+    {
+        other.fd_ = -1;
+    }
+
+    BasicBoard & operator=(BasicBoard && other) noexcept
+    {
+        if (this != &other) {
+            if (fd_ >= 0) {
+                pifacecad_close();
+                open_flag() = false;
+            }
+            fd_ = other.fd_;
+            other.fd_ = -1;
+        }
+        return *this;
+    }
+
+    /* the MCP23S17 SPI file descriptor, -1 once moved from */
+    int fd() const
+    {
+        return fd_;
+    }
+
+    uint8_t read_switches() const
+    {
+        return pifacecad_read_switches();
+    }
+
+    /* switches are active low */
+    bool pressed(uint8_t switch_num) const
+    {
+        return pifacecad_read_switch(switch_num) == 0;
+    }
+
+    /* returns the cursor address after the message */
+    uint8_t write(std::string_view message)
+    {
+        return pifacecad_lcd_write_n(message.data(), message.size());
+    }
+
+    /* an empty segment moves the cursor to the DDRAM address itself,
+     * pifacecad_lcd_set_cursor_address would wrap it at LCD_RAM_WIDTH */
+    uint8_t set_cursor(uint8_t col, uint8_t row)
+    {
+        const pifacecad_lcd_segment here = {col, row, "", 0};
+        return pifacecad_lcd_writev(&here, 1);
+    }
+
+    template <uint8_t Col, uint8_t Row>
+    uint8_t set_cursor()
+    {
+        constexpr uint8_t address = G::template address<Col, Row>();
+        const pifacecad_lcd_segment here = {Col, Row, "", 0};
+        pifacecad_lcd_writev(&here, 1);
+        return address;
+    }
+
+    uint8_t cursor_address() const
+    {
+        return pifacecad_lcd_get_cursor_address();
+    }
+
+    /* raw HD44780 command, see pifacecad::cmd */
+    void command(uint8_t command)
+    {
+        pifacecad_lcd_send_command(command);
+    }
+
+    void clear()
+    {
+        pifacecad_lcd_clear();
+    }
+
+    void home()
+    {
+        pifacecad_lcd_home();
+    }
+
+    void display(bool on)
+    {
+        on ? pifacecad_lcd_display_on() : pifacecad_lcd_display_off();
+    }
+
+    void cursor(bool on)
+    {
+        on ? pifacecad_lcd_cursor_on() : pifacecad_lcd_cursor_off();
+    }
+
+    void blink(bool on)
+    {
+        on ? pifacecad_lcd_blink_on() : pifacecad_lcd_blink_off();
+    }
+
+    void backlight(bool on)
+    {
+        on ? pifacecad_lcd_backlight_on() : pifacecad_lcd_backlight_off();
+    }
+
+    void store_custom_bitmap(uint8_t location, const uint8_t (&bitmap)[8])
+    {
+        uint8_t copy[8];
+        for (int i = 0; i < 8; i++) {
+            copy[i] = bitmap[i];
+        }
+        pifacecad_lcd_store_custom_bitmap(location, copy);
+    }
+
+    void write_custom_bitmap(uint8_t location)
+    {
+        pifacecad_lcd_write_custom_bitmap(location);
+    }
+
+private:
+    static std::atomic<bool> & open_flag()
+    {
+        return detail::board_open;
+    }
+
+    int fd_ = -1;
+};
+
+using Board = BasicBoard<>;
+using Lcd = Board;
+
+} // namespace pifacecad
+
+#endif
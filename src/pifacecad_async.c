@@ -0,0 +1,261 @@
+/**
+ * @file  pifacecad_async.c
+ * @brief Non-blocking LCD functions for PiFace Control and Display.
+ *
+ * Requests are copied into a fixed pool and run on the worker thread
+ * (see pifacecad_rt.c). Each one returns a token straight away and its
+ * completion is signalled on an eventfd which can be added to an
+ * epoll/libuv event loop.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+enum async_op {
+    ASYNC_WRITE,
+    ASYNC_CLEAR,
+    ASYNC_SET_CURSOR,
+    ASYNC_STORE_CUSTOM_BITMAP,
+};
+
+struct async_request {
+    struct cad_job job;
+    int in_use;
+    uint32_t token;
+    enum async_op op;
+    uint8_t args[2];
+    char data[PIFACECAD_ASYNC_MAX_WRITE + 1];
+};
+
+static struct async_request pool[PIFACECAD_ASYNC_QUEUE_LEN];
+static uint32_t completed[PIFACECAD_ASYNC_QUEUE_LEN];
+static int completed_len = 0;
+static int in_flight = 0; // submitted but not yet completed
+static uint32_t next_token = 1;
+static int async_fd = -1;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_idle_cond = PTHREAD_COND_INITIALIZER;
+
+
+// static function definitions
+static uint32_t async_submit(enum async_op op,
+                             uint8_t arg0,
+                             uint8_t arg1,
+                             const void * data,
+                             size_t len);
+static void async_run(void * arg);
+static void async_complete(struct cad_job * job);
+
+
+int pifacecad_async_open(void)
+{
+    pthread_mutex_lock(&async_lock);
+    if (async_fd >= 0) {
+        pthread_mutex_unlock(&async_lock);
+        return async_fd;
+    }
+    // use the real-time worker if there is one, else a plain worker
+    if (cad_rt_acquire() < 0) {
+        pthread_mutex_unlock(&async_lock);
+        return -1;
+    }
+    if ((async_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        pthread_mutex_unlock(&async_lock);
+        cad_rt_release();
+        return -1;
+    }
+    completed_len = 0; // tokens left unreaped at the last close
+    pthread_mutex_unlock(&async_lock);
+    return async_fd;
+}
+
+void pifacecad_async_close(void)
+{
+    pthread_mutex_lock(&async_lock);
+    while (async_fd >= 0 && in_flight > 0) {
+        pthread_cond_wait(&async_idle_cond, &async_lock);
+    }
+    if (async_fd < 0) {
+        pthread_mutex_unlock(&async_lock);
+        return;
+    }
+    close(async_fd);
+    async_fd = -1;
+    pthread_mutex_unlock(&async_lock);
+
+    // outside async_lock, the worker takes it to complete a request
+    cad_rt_release();
+}
+
+int pifacecad_async_fd(void)
+{
+    return async_fd;
+}
+
+int pifacecad_async_reap(uint32_t * tokens, int max)
+{
+    uint64_t count;
+    pthread_mutex_lock(&async_lock);
+    if (read(async_fd, &count, sizeof(count)) < 0) {
+        // nothing new (EAGAIN), hand back anything left from before
+    }
+    int num = completed_len < max ? completed_len : max;
+    memcpy(tokens, completed, num * sizeof(uint32_t));
+    memmove(completed,
+            completed + num,
+            (completed_len - num) * sizeof(uint32_t));
+    completed_len -= num;
+    if (completed_len > 0) {
+        // leave the fd readable for the rest
+        const uint64_t one = 1;
+        if (write(async_fd, &one, sizeof(one)) < 0) {
+            // can only fail if saturated, which is readable anyway
+        }
+    }
+    pthread_mutex_unlock(&async_lock);
+    return num;
+}
+
+uint32_t pifacecad_lcd_write_async(const char * message)
+{
+    size_t len = strlen(message);
+    if (len > PIFACECAD_ASYNC_MAX_WRITE) {
+        errno = EMSGSIZE;
+        return 0;
+    }
+    return async_submit(ASYNC_WRITE, 0, 0, message, len + 1);
+}
+
+uint32_t pifacecad_lcd_clear_async(void)
+{
+    return async_submit(ASYNC_CLEAR, 0, 0, NULL, 0);
+}
+
+uint32_t pifacecad_lcd_set_cursor_async(uint8_t col, uint8_t row)
+{
+    return async_submit(ASYNC_SET_CURSOR, col, row, NULL, 0);
+}
+
+uint32_t pifacecad_lcd_store_custom_bitmap_async(uint8_t location,
+                                                 const uint8_t bitmap[])
+{
+    return async_submit(ASYNC_STORE_CUSTOM_BITMAP, location, 0, bitmap, 8);
+}
+
+static uint32_t async_submit(enum async_op op,
+                             uint8_t arg0,
+                             uint8_t arg1,
+                             const void * data,
+                             size_t len)
+{
+    pthread_mutex_lock(&async_lock);
+    if (async_fd < 0) {
+        pthread_mutex_unlock(&async_lock);
+        errno = ENODEV;
+        return 0;
+    }
+    // a completed token holds its place in the queue until it is reaped
+    if (in_flight + completed_len >= PIFACECAD_ASYNC_QUEUE_LEN) {
+        pthread_mutex_unlock(&async_lock);
+        errno = EAGAIN;
+        return 0;
+    }
+    struct async_request * request = NULL;
+    int i;
+    for (i = 0; i < PIFACECAD_ASYNC_QUEUE_LEN; i++) {
+        if (!pool[i].in_use) {
+            request = &pool[i];
+            break;
+        }
+    }
+    if (request == NULL) {
+        pthread_mutex_unlock(&async_lock);
+        errno = EAGAIN;
+        return 0;
+    }
+    request->in_use = 1;
+    in_flight++;
+    request->token = next_token++;
+    if (next_token == 0) {
+        next_token = 1; // 0 is the error token
+    }
+    request->op = op;
+    request->args[0] = arg0;
+    request->args[1] = arg1;
+    if (len > 0) {
+        memcpy(request->data, data, len);
+    }
+    request->job.func = async_run;
+    request->job.arg = request;
+    request->job.complete = async_complete;
+    const uint32_t token = request->token;
+    pthread_mutex_unlock(&async_lock);
+
+    if (cad_rt_submit(&request->job) < 0) {
+        pthread_mutex_lock(&async_lock);
+        request->in_use = 0;
+        if (--in_flight == 0) {
+            pthread_cond_broadcast(&async_idle_cond);
+        }
+        pthread_mutex_unlock(&async_lock);
+        return 0;
+    }
+    return token;
+}
+
+/* runs on the worker thread */
+static void async_run(void * arg)
+{
+    struct async_request * request = arg;
+    switch (request->op) {
+    case ASYNC_WRITE:
+        pifacecad_lcd_write(request->data);
+        break;
+    case ASYNC_CLEAR:
+        pifacecad_lcd_clear();
+        break;
+    case ASYNC_SET_CURSOR:
+        pifacecad_lcd_set_cursor(request->args[0], request->args[1]);
+        break;
+    case ASYNC_STORE_CUSTOM_BITMAP:
+        pifacecad_lcd_store_custom_bitmap(request->args[0],
+                                          (uint8_t *) request->data);
+        break;
+    }
+}
+
+/* runs on the worker thread */
+static void async_complete(struct cad_job * job)
+{
+    struct async_request * request = job->arg;
+    pthread_mutex_lock(&async_lock);
+    // async_submit keeps in_flight + completed_len within the queue
+    completed[completed_len++] = request->token;
+    request->in_use = 0;
+    if (--in_flight == 0) {
+        pthread_cond_broadcast(&async_idle_cond);
+    }
+    const uint64_t one = 1;
+    if (async_fd >= 0 && write(async_fd, &one, sizeof(one)) < 0) {
+        // saturated, still readable
+    }
+    pthread_mutex_unlock(&async_lock);
+}
@@ -0,0 +1,145 @@
+/**
+ * @file  pifacecad_group.c
+ * @brief Broadcast to several PiFace Control and Displays at once.
+ *
+ * With IOCON.HAEN off an MCP23S17 ignores its address pins and answers
+ * address 0, so every board on the chip select takes the same write.
+ * The LCD traffic is sent once for the whole group; hardware addressing
+ * is only turned back on to read each board's switches.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <mcp23s17.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define BROADCAST_ADDR 0 // HAEN off: every board answers address 0
+
+static const uint8_t ioconfig = BANK_OFF | \
+                                INT_MIRROR_OFF | \
+                                SEQOP_OFF | \
+                                DISSLW_OFF | \
+                                ODR_OFF | \
+                                INTPOL_LOW;
+
+static uint8_t group_addrs[PIFACECAD_MAX_BOARDS];
+static int group_len = 0;
+
+
+// static function definitions
+static void group_broadcast_mode(void);
+static void group_addressed_mode(void);
+
+
+int pifacecad_group_open(const uint8_t * hw_addrs, int num)
+{
+    if (num < 1 || num > PIFACECAD_MAX_BOARDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (cad_sampler_running()) {
+        errno = EBUSY; // it would read every board at once
+        return -1;
+    }
+    const int fd = pifacecad_open_noinit();
+    if (fd < 0) {
+        return -1;
+    }
+
+    cad_lock(); // LCD writes must not go out in addressed mode
+    memcpy(group_addrs, hw_addrs, num);
+    group_len = num;
+    group_broadcast_mode();
+
+    // identical set up for every board, sent once
+    cad_write_reg(0xff, IODIRA, BROADCAST_ADDR);
+    cad_write_reg(0xff, GPPUA, BROADCAST_ADDR);
+    cad_write_reg(0x00, IODIRB, BROADCAST_ADDR);
+    cad_write_reg(0xff, GPINTENA, BROADCAST_ADDR);
+    cad_unlock();
+
+    pifacecad_lcd_init();
+    return fd;
+}
+
+void pifacecad_group_close(void)
+{
+    cad_lock();
+    if (group_len > 0) {
+        group_addressed_mode();
+        group_len = 0;
+    }
+    cad_unlock();
+}
+
+int cad_group_active(void)
+{
+    return __atomic_load_n(&group_len, __ATOMIC_ACQUIRE) > 0;
+}
+
+uint8_t pifacecad_group_read_switches(int board)
+{
+    cad_lock();
+    if (board < 0 || board >= group_len) {
+        cad_unlock();
+        return 0xff; // nothing pressed
+    }
+    group_addressed_mode();
+    const uint8_t switches = cad_read_reg(GPIOA, group_addrs[board]);
+    group_broadcast_mode();
+    cad_unlock();
+    return switches;
+}
+
+int pifacecad_group_read_all_switches(uint8_t * switches)
+{
+    cad_lock();
+    if (group_len == 0) {
+        cad_unlock();
+        errno = ENODEV;
+        return -1;
+    }
+    group_addressed_mode();
+    int i;
+    for (i = 0; i < group_len; i++) {
+        switches[i] = cad_read_reg(GPIOA, group_addrs[i]);
+    }
+    group_broadcast_mode();
+    const int num = group_len;
+    cad_unlock();
+    return num;
+}
+
+/* Boards with HAEN on only answer their own address, boards with HAEN
+ * off only answer address 0, so turning it off everywhere (whatever
+ * state the boards are in) takes a write to each address and to 0. */
+static void group_broadcast_mode(void)
+{
+    int i;
+    for (i = 0; i < group_len; i++) {
+        if (group_addrs[i] != BROADCAST_ADDR) {
+            cad_write_reg(ioconfig | HAEN_OFF, IOCON, group_addrs[i]);
+        }
+    }
+    cad_write_reg(ioconfig | HAEN_OFF, IOCON, BROADCAST_ADDR);
+}
+
+/* all boards answer address 0 in broadcast mode, so one write does it */
+static void group_addressed_mode(void)
+{
+    cad_write_reg(ioconfig | HAEN_ON, IOCON, BROADCAST_ADDR);
+}
@@ -0,0 +1,195 @@
+/**
+ * @file  pifacecad_internal.h
+ * @brief Library internals shared between the pifacecad source files.
+ *
+ * Not installed, not part of the API.
+ */
+#ifndef _PIFACECAD_INTERNAL_H
+#define _PIFACECAD_INTERNAL_H
+
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pifacecad.h"
+
+// MCP23S17 SPI opcodes (0b0100AAAR)
+#define MCP23S17_OPCODE_WRITE(hw_addr) (0x40 | ((hw_addr) << 1))
+#define MCP23S17_OPCODE_READ(hw_addr) (0x40 | ((hw_addr) << 1) | 1)
+
+/**
+ * Takes/releases the (recursive) lock which serialises all LCD and SPI
+ * state changes.
+ */
+void cad_lock(void);
+void cad_unlock(void);
+
+/**
+ * Reads/writes an MCP23S17 register on the board at addr, or on the
+ * simulated board when one is open.
+ */
+uint8_t cad_read_reg(uint8_t reg, uint8_t addr);
+void cad_write_reg(uint8_t data, uint8_t reg, uint8_t addr);
+
+/**
+ * Simulated board (see pifacecad_sim_open).
+ */
+int cad_sim_active(void);
+uint8_t cad_sim_read_reg(uint8_t reg, uint8_t addr);
+void cad_sim_write_reg(uint8_t data, uint8_t reg, uint8_t addr);
+int cad_sim_wait_for_interrupt(uint8_t addr, int timeout_ms);
+
+/**
+ * Returns the MCP23S17 SPI file descriptor.
+ */
+int cad_spi_fd(void);
+
+/**
+ * Returns the MCP23S17 hardware address.
+ */
+uint8_t cad_hw_addr(void);
+
+/**
+ * Reads num registers, each in its own SPI transfer, chained into a
+ * single SPI message (one syscall). Falls back to one mcp23s17_read_reg
+ * per register if the message can't be sent. Returns 0 if the burst was
+ * used, 1 for the fallback.
+ */
+int cad_read_regs(const uint8_t * regs, uint8_t * values, int num);
+
+/**
+ * Returns CLOCK_MONOTONIC in nanoseconds.
+ */
+uint64_t cad_now_ns(void);
+
+/**
+ * Bytes (any value, including 0 for custom bitmap 0) to write from a
+ * DDRAM address (see colrow2address, not wrapped at LCD_RAM_WIDTH).
+ */
+struct cad_lcd_run {
+    uint8_t address;
+    const uint8_t * buf;
+    size_t len;
+};
+
+/**
+ * Writes num runs to the LCD as one batch under one lock. Returns the
+ * new cursor address.
+ */
+uint8_t cad_lcd_write_runs(const struct cad_lcd_run * runs, int num);
+
+/**
+ * Writes num rows of custom bitmap location, from first_row, as one batch.
+ */
+void cad_lcd_cgram_write(uint8_t location,
+                         uint8_t first_row,
+                         const uint8_t * rows,
+                         int num);
+
+/**
+ * Sets the display, cursor and blink flags (LCD_DISPLAYON etc.) with one
+ * command, or none if they are already set.
+ */
+void cad_lcd_set_display_control(uint8_t display_control);
+
+/**
+ * Moves the display so that DDRAM column shift is at its left edge, with
+ * one return home command when shift is 0, else as few display shift
+ * commands as possible, all in one batch.
+ */
+void cad_lcd_set_display_shift(uint8_t shift);
+
+/**
+ * Sets the backlight bit on GPIOB unless the last value written already
+ * has it. PWM edges (publish 0) aren't published to the display mirror
+ * or the latency measurement, a lasting level (publish 1) is. Returns 1
+ * if it wrote GPIOB, 0 if not.
+ */
+int cad_lcd_put_backlight(uint8_t state, int publish);
+
+/**
+ * Returns the backlight PWM level (0 or 1) at CLOCK_MONOTONIC time_ns,
+ * or state if PWM isn't running.
+ */
+uint8_t cad_pwm_backlight(uint64_t time_ns, uint8_t state);
+
+/**
+ * Copies the custom bitmap the library last stored at location into
+ * bitmap. Returns 0, or -1 if nothing has been stored there.
+ */
+int cad_lcd_cgram_get(uint8_t location, uint8_t bitmap[]);
+
+/**
+ * Copies the library's view of the display into snapshot.
+ */
+void cad_lcd_snapshot(struct pifacecad_display_snapshot * snapshot);
+
+/**
+ * Publishes the display to the shared memory mirror, if it is open.
+ * Called with the LCD lock held at the end of every operation which
+ * wrote to the LCD port.
+ */
+void cad_mirror_commit(void);
+
+/**
+ * Returns 1 if a broadcast group is open (see pifacecad_group_open). The
+ * boards all answer address 0 then, so nothing may be read back.
+ */
+int cad_group_active(void);
+
+/**
+ * Returns 1 if the switch sampler is running (see pifacecad_sampler_start).
+ */
+int cad_sampler_running(void);
+
+/**
+ * Latency measurement hooks (see pifacecad_latency_start): switches is
+ * every switch port value the library reads, visible marks the last
+ * enable pulse of something which shows on the screen, commit marks the
+ * end of an LCD operation (called with the LCD lock held).
+ */
+void cad_latency_switches(uint8_t switches, uint64_t at_ns);
+void cad_latency_visible(void);
+void cad_latency_commit(void);
+
+/**
+ * A unit of work for the real-time worker thread.
+ */
+struct cad_job {
+    void (*func)(void *);
+    void * arg;
+    void (*complete)(struct cad_job *); // NULL for pifacecad_rt_call
+    struct timespec submitted;
+    int done;
+};
+
+/**
+ * Queues job on the worker without waiting. job->complete is called on
+ * the worker once job->func has run. Returns 0 on success, -1 if the
+ * worker isn't running (ENODEV) or its queue is full (EAGAIN).
+ */
+int cad_rt_submit(struct cad_job * job);
+
+/**
+ * Returns 1 if the real-time worker is running.
+ */
+int cad_rt_running(void);
+
+/**
+ * Returns 1 if the real-time worker is running and this isn't it, so the
+ * library's LCD and switch functions should hand their work over to it.
+ */
+int cad_rt_routing(void);
+
+/**
+ * Takes a reference on the worker, starting a plain one (no real-time
+ * settings) if none is running. Returns 0 on success, -1 on error.
+ */
+int cad_rt_acquire(void);
+
+/**
+ * Drops a reference taken with cad_rt_acquire. The last one stops the
+ * worker, once its queue has run, if cad_rt_acquire started it.
+ */
+void cad_rt_release(void);
+
+#endif
@@ -0,0 +1,151 @@
+/**
+ * @file  pifacecad_latency.c
+ * @brief Switch to screen latency measurement for PiFace Control and
+ * Display.
+ *
+ * Times from a switch edge (seen by pifacecad_read_switches or the
+ * sampler) to the last enable pulse of the first LCD operation after it
+ * which changes what is on the screen.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+static int enabled = 0;
+static int have_switches = 0;
+static uint8_t last_switches;
+static uint64_t edge_ns = 0; // oldest edge not answered yet, 0 for none
+static uint64_t visible_ns = 0; // last visible pulse since edge_ns
+static uint64_t samples[PIFACECAD_LATENCY_MAX_SAMPLES];
+static unsigned long count = 0; // samples ever recorded
+static uint64_t min_ns, max_ns, total_ns;
+static unsigned long histogram[PIFACECAD_LATENCY_BUCKETS];
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// static function definitions
+static int compare_u64(const void * a, const void * b);
+
+
+void pifacecad_latency_start(void)
+{
+    pthread_mutex_lock(&latency_lock);
+    have_switches = 0;
+    edge_ns = visible_ns = 0;
+    count = 0;
+    min_ns = UINT64_MAX;
+    max_ns = total_ns = 0;
+    memset(histogram, 0, sizeof(histogram));
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&latency_lock);
+}
+
+void pifacecad_latency_stop(void)
+{
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+}
+
+void pifacecad_latency_stats(struct pifacecad_latency_stats * stats)
+{
+    static uint64_t sorted[PIFACECAD_LATENCY_MAX_SAMPLES];
+
+    pthread_mutex_lock(&latency_lock);
+    memset(stats, 0, sizeof(*stats));
+    stats->count = count;
+    memcpy(stats->histogram, histogram, sizeof(histogram));
+    if (count > 0) {
+        stats->min_ns = min_ns;
+        stats->max_ns = max_ns;
+        stats->mean_ns = total_ns / count;
+
+        // percentiles of the most recent samples
+        const size_t num = count < PIFACECAD_LATENCY_MAX_SAMPLES ? \
+            count : PIFACECAD_LATENCY_MAX_SAMPLES;
+        memcpy(sorted, samples, num * sizeof(uint64_t));
+        qsort(sorted, num, sizeof(uint64_t), compare_u64);
+        stats->p50_ns = sorted[(num - 1) * 50 / 100];
+        stats->p90_ns = sorted[(num - 1) * 90 / 100];
+        stats->p99_ns = sorted[(num - 1) * 99 / 100];
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+void cad_latency_switches(uint8_t switches, uint64_t at_ns)
+{
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&latency_lock);
+    if (have_switches && switches != last_switches && edge_ns == 0) {
+        // time from the first edge until the screen answers
+        edge_ns = at_ns;
+        visible_ns = 0;
+    }
+    last_switches = switches;
+    have_switches = 1;
+    pthread_mutex_unlock(&latency_lock);
+}
+
+void cad_latency_visible(void)
+{
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&latency_lock);
+    if (edge_ns != 0) {
+        visible_ns = cad_now_ns();
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+void cad_latency_commit(void)
+{
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&latency_lock);
+    if (edge_ns != 0 && visible_ns > edge_ns) {
+        const uint64_t latency = visible_ns - edge_ns;
+        samples[count % PIFACECAD_LATENCY_MAX_SAMPLES] = latency;
+        count++;
+        total_ns += latency;
+        if (latency < min_ns) {
+            min_ns = latency;
+        }
+        if (latency > max_ns) {
+            max_ns = latency;
+        }
+        // bucket i holds [2^i, 2^(i+1)) microseconds
+        uint64_t us = latency / 1000;
+        int bucket = 0;
+        while (us > 1 && bucket < PIFACECAD_LATENCY_BUCKETS - 1) {
+            us >>= 1;
+            bucket++;
+        }
+        histogram[bucket]++;
+        edge_ns = visible_ns = 0;
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+static int compare_u64(const void * a, const void * b)
+{
+    const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
@@ -0,0 +1,167 @@
+/**
+ * @file  pifacecad_mirror.c
+ * @brief Shared memory mirror of the PiFace Control and Display screen.
+ *
+ * The writer copies the library's view of the display into a POSIX
+ * shared memory object after every operation, under a seqlock. Readers
+ * map it read-only and retry if they raced with an update, so they never
+ * block the writer or touch the SPI bus.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define MIRROR_MAGIC 0x5043414d // "PCAM"
+#define MIRROR_READ_TRIES 1000
+
+struct mirror {
+    uint32_t magic;
+    uint32_t seq; // odd while an update is being written
+    struct pifacecad_display_snapshot snapshot;
+};
+
+static struct mirror * writer = NULL;
+static struct mirror * reader = NULL;
+static char reader_name[64];
+
+
+// static function definitions
+static struct mirror * mirror_map(const char * name, int writable);
+
+
+int pifacecad_mirror_open(const char * name)
+{
+    if (writer != NULL) {
+        return 0;
+    }
+    if ((writer = mirror_map(name, 1)) == NULL) {
+        return -1;
+    }
+    // a previous writer may have died half way through an update
+    if (writer->seq & 1) {
+        __atomic_store_n(&writer->seq, writer->seq + 1, __ATOMIC_RELEASE);
+    }
+    cad_mirror_commit(); // publish what is there now
+    return 0;
+}
+
+void pifacecad_mirror_close(void)
+{
+    if (writer != NULL) {
+        munmap(writer, sizeof(struct mirror));
+        writer = NULL;
+    }
+}
+
+void cad_mirror_commit(void)
+{
+    if (writer == NULL) {
+        return;
+    }
+    struct pifacecad_display_snapshot snapshot;
+    cad_lcd_snapshot(&snapshot);
+
+    // writers are serialised by the LCD lock
+    const uint32_t seq = __atomic_load_n(&writer->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&writer->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    writer->snapshot = snapshot;
+    __atomic_store_n(&writer->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int pifacecad_mirror_read(const char * name,
+                          struct pifacecad_display_snapshot * snapshot)
+{
+    if (name == NULL) {
+        name = PIFACECAD_MIRROR_NAME;
+    }
+    if (reader != NULL && strcmp(name, reader_name) != 0) {
+        munmap(reader, sizeof(struct mirror));
+        reader = NULL;
+    }
+    if (reader == NULL) {
+        if ((reader = mirror_map(name, 0)) == NULL) {
+            return -1;
+        }
+        strncpy(reader_name, name, sizeof(reader_name) - 1);
+    }
+    if (__atomic_load_n(&reader->magic, __ATOMIC_ACQUIRE) != MIRROR_MAGIC) {
+        errno = ENODATA; // nothing published yet
+        return -1;
+    }
+
+    int tries;
+    for (tries = 0; tries < MIRROR_READ_TRIES; tries++) {
+        const uint32_t seq0 = __atomic_load_n(&reader->seq, __ATOMIC_ACQUIRE);
+        if (seq0 & 1) {
+            continue; // being written
+        }
+        *snapshot = reader->snapshot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&reader->seq, __ATOMIC_RELAXED) == seq0) {
+            return 0;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+static struct mirror * mirror_map(const char * name, int writable)
+{
+    if (name == NULL) {
+        name = PIFACECAD_MIRROR_NAME;
+    }
+    int fd;
+    if (writable) {
+        fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    } else {
+        fd = shm_open(name, O_RDONLY, 0);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+    if (writable && ftruncate(fd, sizeof(struct mirror)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || \
+            (size_t) st.st_size < sizeof(struct mirror)) {
+        close(fd);
+        errno = ENODATA;
+        return NULL;
+    }
+    struct mirror * mirror = mmap(NULL,
+                                  sizeof(struct mirror),
+                                  writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                                  MAP_SHARED,
+                                  fd,
+                                  0);
+    close(fd);
+    if (mirror == MAP_FAILED) {
+        return NULL;
+    }
+    if (writable) {
+        __atomic_store_n(&mirror->magic, MIRROR_MAGIC, __ATOMIC_RELEASE);
+    }
+    return mirror;
+}
@@ -0,0 +1,139 @@
+/**
+ * @file  pifacecad_pager.c
+ * @brief Page flipping with the HD44780 display shift.
+ *
+ * Each row of DDRAM is 40 characters, 16 of which are visible. The pager
+ * keeps the page being read in one 16 column half and writes the next
+ * one into the other half, out of sight. Turning the page only moves the
+ * display: a return home, or display shift commands in one SPI message.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+// guarded by pager_lock, which is never held while waiting on the LCD
+// lock's owner (the scheduler's worker takes the LCD lock)
+static int pager_open = 0;
+static int showing = 0; // half of DDRAM on the display
+static int prefetched = 0; // the other half holds the next page
+static int queued = 0; // ... or will once the scheduler has sent it
+static pthread_mutex_t pager_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// static function definitions
+static void page_layout(const char * page,
+                        size_t len,
+                        char rows[LCD_MAX_LINES][PIFACECAD_PAGER_WIDTH]);
+
+
+int pifacecad_pager_open(void)
+{
+    pthread_mutex_lock(&pager_lock);
+    cad_lcd_set_display_shift(0);
+    showing = 0;
+    prefetched = 0;
+    queued = 0;
+    pager_open = 1;
+    pthread_mutex_unlock(&pager_lock);
+    return 0;
+}
+
+void pifacecad_pager_close(void)
+{
+    pthread_mutex_lock(&pager_lock);
+    if (queued) {
+        pifacecad_sched_wait();
+    }
+    cad_lcd_set_display_shift(0);
+    pager_open = 0;
+    pthread_mutex_unlock(&pager_lock);
+}
+
+int pifacecad_pager_prefetch(const char * page, size_t len)
+{
+    pthread_mutex_lock(&pager_lock);
+    if (!pager_open) {
+        pthread_mutex_unlock(&pager_lock);
+        errno = ENODEV;
+        return -1;
+    }
+    char rows[LCD_MAX_LINES][PIFACECAD_PAGER_WIDTH];
+    page_layout(page, len, rows);
+    const uint8_t col = (1 - showing) * PIFACECAD_PAGER_WIDTH;
+
+    // in the background if there is a scheduler, else now
+    int row;
+    queued = 1;
+    for (row = 0; row < LCD_MAX_LINES && queued; row++) {
+        queued = pifacecad_sched_write(col, row,
+                                       rows[row], PIFACECAD_PAGER_WIDTH,
+                                       PIFACECAD_PRIORITY_LOW) == 0;
+    }
+    if (!queued) {
+        struct pifacecad_lcd_segment segments[LCD_MAX_LINES];
+        for (row = 0; row < LCD_MAX_LINES; row++) {
+            segments[row].col = col;
+            segments[row].row = row;
+            segments[row].buf = rows[row];
+            segments[row].len = PIFACECAD_PAGER_WIDTH;
+        }
+        pifacecad_lcd_writev(segments, LCD_MAX_LINES);
+    }
+    prefetched = 1;
+    pthread_mutex_unlock(&pager_lock);
+    return 0;
+}
+
+int pifacecad_pager_flip(void)
+{
+    pthread_mutex_lock(&pager_lock);
+    if (!pager_open || !prefetched) {
+        pthread_mutex_unlock(&pager_lock);
+        errno = pager_open ? EAGAIN : ENODEV;
+        return -1;
+    }
+    if (queued) {
+        pifacecad_sched_wait(); // the page has to be there before it shows
+        queued = 0;
+    }
+    showing = 1 - showing;
+    cad_lcd_set_display_shift(showing * PIFACECAD_PAGER_WIDTH);
+    prefetched = 0;
+    pthread_mutex_unlock(&pager_lock);
+    return 0;
+}
+
+/* splits page into rows at '\n', padding with spaces and dropping
+ * whatever doesn't fit */
+static void page_layout(const char * page,
+                        size_t len,
+                        char rows[LCD_MAX_LINES][PIFACECAD_PAGER_WIDTH])
+{
+    memset(rows, ' ', LCD_MAX_LINES * PIFACECAD_PAGER_WIDTH);
+    int row = 0, col = 0;
+    size_t i;
+    for (i = 0; i < len && row < LCD_MAX_LINES; i++) {
+        if (page[i] == '\n') {
+            row++;
+            col = 0;
+        } else if (col < PIFACECAD_PAGER_WIDTH) {
+            rows[row][col++] = page[i];
+        }
+    }
+}
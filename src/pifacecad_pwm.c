@@ -0,0 +1,218 @@
+/**
+ * @file  pifacecad_pwm.c
+ * @brief Software backlight dimming for PiFace Control and Display.
+ *
+ * The backlight is switched on for duty / 255 of every period. The LCD
+ * transfers (see lcd_batch_flush) already rewrite GPIOB, backlight bit
+ * included, so each one carries the level for the time it goes out and
+ * a timer thread only writes the edges which no LCD transfer has. Every
+ * edge write is a three byte SPI message and the frequency is lowered to
+ * keep them within the bandwidth cap.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define PWM_EDGE_BYTES 3 // opcode, GPIOB, value
+#define PWM_IDLE_NS 100000000L // 100ms, while fully on or off
+
+// read by the LCD path without a lock, a torn update costs one period
+static int pwm_running = 0;
+static uint64_t pwm_epoch_ns = 0; // start of a period
+static uint64_t pwm_period_ns = 0;
+static uint64_t pwm_on_ns = 0; // backlight on for the start of each period
+
+static int pwm_stopping = 0;
+static int pwm_woken = 0; // the duty changed or we are stopping
+static unsigned long pwm_edges = 0;
+static unsigned long pwm_merged = 0;
+static pthread_t pwm_thread;
+static pthread_mutex_t pwm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pwm_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pwm_wake_cond; // CLOCK_MONOTONIC, never destroyed
+static pthread_once_t pwm_wake_once = PTHREAD_ONCE_INIT;
+
+
+// static function definitions
+static void * pwm_worker(void * arg);
+static void pwm_wake_init(void);
+static void pwm_wake(void);
+static uint64_t pwm_on_for(uint8_t duty, uint64_t period_ns);
+
+
+int pifacecad_backlight_pwm_start(uint8_t duty,
+                                  unsigned int freq_hz,
+                                  unsigned int max_bytes_per_sec)
+{
+    freq_hz = freq_hz > 0 ? freq_hz : PIFACECAD_PWM_HZ;
+    max_bytes_per_sec = max_bytes_per_sec > 0 ? \
+        max_bytes_per_sec : PIFACECAD_PWM_MAX_BYTES_PER_SEC;
+
+    // two edges a period
+    const unsigned int max_hz = max_bytes_per_sec / (2 * PWM_EDGE_BYTES);
+    if (max_hz == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    freq_hz = freq_hz < max_hz ? freq_hz : max_hz;
+
+    pthread_mutex_lock(&pwm_lock);
+    if (__atomic_load_n(&pwm_running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&pwm_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    const uint64_t period_ns = 1000000000ULL / freq_hz;
+    __atomic_store_n(&pwm_period_ns, period_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&pwm_on_ns, pwm_on_for(duty, period_ns),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&pwm_epoch_ns, cad_now_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&pwm_stopping, 0, __ATOMIC_RELAXED);
+    pwm_edges = 0;
+    pwm_merged = 0;
+    pwm_woken = 0;
+    pthread_once(&pwm_wake_once, pwm_wake_init);
+    __atomic_store_n(&pwm_running, 1, __ATOMIC_RELEASE);
+
+    const int ret = pthread_create(&pwm_thread, NULL, pwm_worker, NULL);
+    if (ret != 0) {
+        __atomic_store_n(&pwm_running, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&pwm_lock);
+        errno = ret;
+        return -1;
+    }
+    pthread_mutex_unlock(&pwm_lock);
+    return 0;
+}
+
+int pifacecad_backlight_pwm_set(uint8_t duty)
+{
+    if (!__atomic_load_n(&pwm_running, __ATOMIC_ACQUIRE)) {
+        errno = ENODEV;
+        return -1;
+    }
+    const uint64_t period_ns = __atomic_load_n(&pwm_period_ns,
+                                               __ATOMIC_RELAXED);
+    __atomic_store_n(&pwm_on_ns, pwm_on_for(duty, period_ns),
+                     __ATOMIC_RELEASE);
+    pwm_wake(); // it may be idling at 0 or 255
+    return 0;
+}
+
+void pifacecad_backlight_pwm_stop(void)
+{
+    pthread_mutex_lock(&pwm_lock);
+    if (!__atomic_load_n(&pwm_running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&pwm_lock);
+        return;
+    }
+    __atomic_store_n(&pwm_stopping, 1, __ATOMIC_RELEASE);
+    pwm_wake();
+    pthread_join(pwm_thread, NULL);
+    __atomic_store_n(&pwm_running, 0, __ATOMIC_RELEASE);
+
+    // leave it on unless it was dimmed right down
+    const uint64_t on_ns = __atomic_load_n(&pwm_on_ns, __ATOMIC_RELAXED);
+    cad_lcd_put_backlight(on_ns > 0, 1);
+    pthread_mutex_unlock(&pwm_lock);
+}
+
+void pifacecad_backlight_pwm_stats(unsigned long * edges,
+                                   unsigned long * merged)
+{
+    pthread_mutex_lock(&pwm_lock);
+    *edges = __atomic_load_n(&pwm_edges, __ATOMIC_RELAXED);
+    *merged = __atomic_load_n(&pwm_merged, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pwm_lock);
+}
+
+uint8_t cad_pwm_backlight(uint64_t time_ns, uint8_t state)
+{
+    if (!__atomic_load_n(&pwm_running, __ATOMIC_ACQUIRE)) {
+        return state;
+    }
+    const uint64_t epoch = __atomic_load_n(&pwm_epoch_ns, __ATOMIC_RELAXED);
+    const uint64_t period = __atomic_load_n(&pwm_period_ns, __ATOMIC_RELAXED);
+    const uint64_t on = __atomic_load_n(&pwm_on_ns, __ATOMIC_RELAXED);
+    return time_ns < epoch || (time_ns - epoch) % period < on;
+}
+
+/* writes the level for now, unless the last GPIOB write (an LCD transfer)
+ * already has, then sleeps until the next edge or a change of duty */
+static void * pwm_worker(void * arg)
+{
+    (void) arg;
+    while (!__atomic_load_n(&pwm_stopping, __ATOMIC_ACQUIRE)) {
+        const uint64_t epoch = pwm_epoch_ns;
+        const uint64_t period = pwm_period_ns;
+        const uint64_t on = __atomic_load_n(&pwm_on_ns, __ATOMIC_ACQUIRE);
+        const uint64_t now = cad_now_ns();
+        const uint64_t start = now - (now - epoch) % period;
+
+        const uint8_t level = cad_pwm_backlight(now, 0);
+        const int wrote = cad_lcd_put_backlight(level, 0);
+        uint64_t edge;
+        if (on == 0 || on >= period) {
+            edge = now + PWM_IDLE_NS; // no edges, keep an eye on the duty
+        } else {
+            edge = now - start < on ? start + on : start + period;
+            __atomic_add_fetch(wrote ? &pwm_edges : &pwm_merged, 1,
+                               __ATOMIC_RELAXED);
+        }
+
+        struct timespec until;
+        until.tv_sec = edge / 1000000000ULL;
+        until.tv_nsec = edge % 1000000000ULL;
+        pthread_mutex_lock(&pwm_wake_lock);
+        while (!pwm_woken && \
+                pthread_cond_timedwait(&pwm_wake_cond,
+                                       &pwm_wake_lock,
+                                       &until) != ETIMEDOUT) {
+            // spurious wake up, sleep on
+        }
+        pwm_woken = 0;
+        pthread_mutex_unlock(&pwm_wake_lock);
+    }
+    return NULL;
+}
+
+/* The worker sleeps until absolute CLOCK_MONOTONIC times. The condition
+ * outlives every start and stop, since pifacecad_backlight_pwm_set may
+ * still be waking it as the worker stops. */
+static void pwm_wake_init(void)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pwm_wake_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static void pwm_wake(void)
+{
+    pthread_mutex_lock(&pwm_wake_lock);
+    pwm_woken = 1;
+    pthread_cond_signal(&pwm_wake_cond);
+    pthread_mutex_unlock(&pwm_wake_lock);
+}
+
+static uint64_t pwm_on_for(uint8_t duty, uint64_t period_ns)
+{
+    return period_ns * duty / 255;
+}
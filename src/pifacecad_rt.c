@@ -0,0 +1,344 @@
+/**
+ * @file  pifacecad_rt.c
+ * @brief Real-time worker thread for PiFace Control and Display.
+ *
+ * While it runs, the library's LCD and switch functions (and any work
+ * submitted with pifacecad_rt_call) run on one thread which can be given
+ * a SCHED_FIFO priority, pinned to a core and have its memory locked so
+ * that the short HD44780 delays are not stretched by other load on the
+ * system.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define RT_QUEUE_LEN 64
+#define RT_DEFAULT_STACK_PREFAULT (64 * 1024)
+#define RT_STACK_MARGIN (16 * 1024) // left for the jobs when pre-faulting
+
+static pthread_t rt_thread;
+static pthread_mutex_t rt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rt_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rt_done_cond = PTHREAD_COND_INITIALIZER;
+static struct cad_job * rt_queue[RT_QUEUE_LEN];
+static int rt_head = 0, rt_tail = 0; // ring indexes, head == tail is empty
+static int rt_running = 0; // started, or being started
+static int rt_ready = 0; // the worker is taking jobs
+static int rt_stopping = 0;
+static struct pifacecad_rt_config rt_config;
+
+// cad_rt_acquire references, taken before rt_lock
+static pthread_mutex_t rt_users_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rt_users = 0;
+static int rt_owned = 0; // the worker was started by cad_rt_acquire
+
+static unsigned long rt_missed = 0;
+static long rt_worst_ns = 0;
+
+
+// static function definitions
+static void rt_start_failed(int error);
+static void * rt_worker(void * arg);
+static void rt_prefault_stack(size_t size);
+static long timespec_diff_ns(const struct timespec * a,
+                             const struct timespec * b);
+
+
+int pifacecad_rt_start(const struct pifacecad_rt_config * config)
+{
+    pthread_mutex_lock(&rt_lock);
+    if (rt_running) {
+        pthread_mutex_unlock(&rt_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    rt_running = 1; // claimed, nobody else can start one now
+    memset(&rt_config, 0, sizeof(rt_config));
+    rt_config.cpu = -1;
+    if (config != NULL) {
+        rt_config = *config;
+    }
+    if (rt_config.stack_prefault == 0) {
+        rt_config.stack_prefault = RT_DEFAULT_STACK_PREFAULT;
+    }
+    rt_head = rt_tail = 0;
+    rt_missed = 0;
+    rt_worst_ns = 0;
+    rt_stopping = 0;
+    pthread_mutex_unlock(&rt_lock);
+
+    // lock everything we have and everything we will map from now on
+    if (rt_config.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        rt_start_failed(errno);
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int ret = 0;
+    if (rt_config.priority > 0) {
+        struct sched_param param;
+        param.sched_priority = rt_config.priority;
+        ret = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (ret == 0) {
+            ret = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        }
+        if (ret == 0) {
+            ret = pthread_attr_setschedparam(&attr, &param); // EINVAL: 1-99
+        }
+    }
+    if (ret == 0 && rt_config.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(rt_config.cpu, &cpus);
+        ret = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    // the pre-faulted part of the stack has to fit in the stack
+    size_t stack_size;
+    if (ret == 0 && pthread_attr_getstacksize(&attr, &stack_size) == 0) {
+        const size_t most = stack_size > 2 * RT_STACK_MARGIN ? \
+            stack_size - RT_STACK_MARGIN : stack_size / 2;
+        if (rt_config.stack_prefault > most) {
+            rt_config.stack_prefault = most;
+        }
+    }
+
+    if (ret == 0) {
+        ret = pthread_create(&rt_thread, &attr, rt_worker, NULL);
+    }
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        if (rt_config.lock_memory) {
+            munlockall();
+        }
+        rt_start_failed(ret); // EPERM without CAP_SYS_NICE, EINVAL for cpu
+        return -1;
+    }
+
+    pthread_mutex_lock(&rt_lock);
+    rt_ready = 1;
+    pthread_mutex_unlock(&rt_lock);
+    return 0;
+}
+
+void pifacecad_rt_stop(void)
+{
+    pthread_mutex_lock(&rt_lock);
+    if (!rt_ready) {
+        pthread_mutex_unlock(&rt_lock);
+        return;
+    }
+    rt_stopping = 1;
+    pthread_cond_broadcast(&rt_job_cond);
+    pthread_mutex_unlock(&rt_lock);
+
+    pthread_join(rt_thread, NULL);
+
+    pthread_mutex_lock(&rt_lock);
+    rt_ready = 0;
+    rt_running = 0;
+    pthread_mutex_unlock(&rt_lock);
+
+    if (rt_config.lock_memory) {
+        munlockall();
+    }
+}
+
+int pifacecad_rt_call(void (*func)(void *), void * arg)
+{
+    struct cad_job job;
+    job.func = func;
+    job.arg = arg;
+    job.complete = NULL;
+    job.done = 0;
+
+    pthread_mutex_lock(&rt_lock);
+    if (!rt_ready || rt_stopping || \
+            pthread_equal(pthread_self(), rt_thread)) {
+        // no worker (or we are the worker), just run it here
+        pthread_mutex_unlock(&rt_lock);
+        func(arg);
+        return 0;
+    }
+    while ((rt_tail + 1) % RT_QUEUE_LEN == rt_head) {
+        pthread_cond_wait(&rt_done_cond, &rt_lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &job.submitted);
+    rt_queue[rt_tail] = &job;
+    rt_tail = (rt_tail + 1) % RT_QUEUE_LEN;
+    pthread_cond_signal(&rt_job_cond);
+
+    while (!job.done) {
+        pthread_cond_wait(&rt_done_cond, &rt_lock);
+    }
+    pthread_mutex_unlock(&rt_lock);
+    return 0;
+}
+
+int cad_rt_submit(struct cad_job * job)
+{
+    pthread_mutex_lock(&rt_lock);
+    if (!rt_ready || rt_stopping) {
+        pthread_mutex_unlock(&rt_lock);
+        errno = ENODEV;
+        return -1;
+    }
+    if ((rt_tail + 1) % RT_QUEUE_LEN == rt_head) {
+        pthread_mutex_unlock(&rt_lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    job->done = 0;
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+    rt_queue[rt_tail] = job;
+    rt_tail = (rt_tail + 1) % RT_QUEUE_LEN;
+    pthread_cond_signal(&rt_job_cond);
+    pthread_mutex_unlock(&rt_lock);
+    return 0;
+}
+
+int cad_rt_running(void)
+{
+    pthread_mutex_lock(&rt_lock);
+    const int running = rt_ready && !rt_stopping;
+    pthread_mutex_unlock(&rt_lock);
+    return running;
+}
+
+int cad_rt_routing(void)
+{
+    pthread_mutex_lock(&rt_lock);
+    const int routing = rt_ready && !rt_stopping && \
+        !pthread_equal(pthread_self(), rt_thread);
+    pthread_mutex_unlock(&rt_lock);
+    return routing;
+}
+
+int cad_rt_acquire(void)
+{
+    pthread_mutex_lock(&rt_users_lock);
+    if (rt_users == 0 && !cad_rt_running()) {
+        if (pifacecad_rt_start(NULL) < 0) {
+            pthread_mutex_unlock(&rt_users_lock);
+            return -1;
+        }
+        rt_owned = 1;
+    }
+    rt_users++;
+    pthread_mutex_unlock(&rt_users_lock);
+    return 0;
+}
+
+void cad_rt_release(void)
+{
+    pthread_mutex_lock(&rt_users_lock);
+    if (rt_users > 0 && --rt_users == 0 && rt_owned) {
+        pifacecad_rt_stop(); // runs everything still queued
+        rt_owned = 0;
+    }
+    pthread_mutex_unlock(&rt_users_lock);
+}
+
+unsigned long pifacecad_rt_missed_deadlines(void)
+{
+    pthread_mutex_lock(&rt_lock);
+    const unsigned long missed = rt_missed;
+    pthread_mutex_unlock(&rt_lock);
+    return missed;
+}
+
+long pifacecad_rt_worst_latency_ns(void)
+{
+    pthread_mutex_lock(&rt_lock);
+    const long worst = rt_worst_ns;
+    pthread_mutex_unlock(&rt_lock);
+    return worst;
+}
+
+/* gives up the claim pifacecad_rt_start made */
+static void rt_start_failed(int error)
+{
+    pthread_mutex_lock(&rt_lock);
+    rt_running = 0;
+    pthread_mutex_unlock(&rt_lock);
+    errno = error;
+}
+
+static void * rt_worker(void * arg)
+{
+    (void) arg;
+    rt_prefault_stack(rt_config.stack_prefault);
+
+    pthread_mutex_lock(&rt_lock);
+    while (1) {
+        while (rt_head == rt_tail && !rt_stopping) {
+            pthread_cond_wait(&rt_job_cond, &rt_lock);
+        }
+        if (rt_head == rt_tail) {
+            break; // stopping and nothing left to do
+        }
+        struct cad_job * job = rt_queue[rt_head];
+        rt_head = (rt_head + 1) % RT_QUEUE_LEN;
+        pthread_mutex_unlock(&rt_lock);
+
+        job->func(job->arg);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const long latency = timespec_diff_ns(&now, &job->submitted);
+
+        pthread_mutex_lock(&rt_lock);
+        if (latency > rt_worst_ns) {
+            rt_worst_ns = latency;
+        }
+        if (rt_config.deadline_ns > 0 && latency > rt_config.deadline_ns) {
+            rt_missed++;
+        }
+        if (job->complete != NULL) {
+            // asynchronous job, the owner may reuse it from here on
+            pthread_mutex_unlock(&rt_lock);
+            job->complete(job);
+            pthread_mutex_lock(&rt_lock);
+        } else {
+            job->done = 1;
+        }
+        pthread_cond_broadcast(&rt_done_cond);
+    }
+    pthread_mutex_unlock(&rt_lock);
+    return NULL;
+}
+
+/* touch the stack now so that we don't take page faults later on */
+static void rt_prefault_stack(size_t size)
+{
+    uint8_t stack[size];
+    memset(stack, 0, size);
+    __asm__ __volatile__("" : : "r" (stack) : "memory"); // keep the memset
+}
+
+static long timespec_diff_ns(const struct timespec * a,
+                             const struct timespec * b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
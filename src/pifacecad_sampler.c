@@ -0,0 +1,207 @@
+/**
+ * @file  pifacecad_sampler.c
+ * @brief Background switch sampler for PiFace Control and Display.
+ *
+ * A thread reads INTFA, INTCAPA and GPIOA (one SPI message) at a fixed
+ * rate and stores each change of the switch port, with a CLOCK_MONOTONIC
+ * timestamp, in a lock-free ring. Readers never touch the SPI bus.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <mcp23s17.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+struct sampler_slot {
+    uint64_t seq; // sequence number + 1 of the sample held, 0 when empty
+    struct pifacecad_switch_sample sample;
+};
+
+static struct sampler_slot ring[PIFACECAD_SAMPLER_RING_LEN];
+static uint64_t ring_head = 0; // sequence number of the next sample
+static uint8_t cur_switches = 0xff; // switches are pulled up
+static pthread_t sampler_thread;
+static pthread_mutex_t sampler_lock = PTHREAD_MUTEX_INITIALIZER; // start/stop
+static int sampler_running = 0;
+static int sampler_stopping = 0;
+static long sampler_period_ns = 0;
+static int event_fd = -1; // signalled on every change, if anyone asked
+
+
+// static function definitions
+static void * sampler_worker(void * arg);
+static void sampler_push(uint64_t timestamp_ns, uint8_t switches);
+
+
+int pifacecad_sampler_start(unsigned int rate_hz)
+{
+    if (rate_hz == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&sampler_lock);
+    if (sampler_running || cad_group_active()) {
+        pthread_mutex_unlock(&sampler_lock);
+        errno = EBUSY; // running, or every board would answer at once
+        return -1;
+    }
+    __atomic_store_n(&sampler_running, 1, __ATOMIC_RELEASE);
+    sampler_period_ns = 1000000000L / rate_hz;
+
+    // first sample is the starting state, not a change
+    const uint8_t switches = pifacecad_read_switches();
+    __atomic_store_n(&cur_switches, switches, __ATOMIC_RELEASE);
+    sampler_push(cad_now_ns(), switches);
+
+    __atomic_store_n(&sampler_stopping, 0, __ATOMIC_RELEASE);
+    int ret = pthread_create(&sampler_thread, NULL, sampler_worker, NULL);
+    if (ret != 0) {
+        __atomic_store_n(&sampler_running, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&sampler_lock);
+        errno = ret;
+        return -1;
+    }
+    pthread_mutex_unlock(&sampler_lock);
+    return 0;
+}
+
+void pifacecad_sampler_stop(void)
+{
+    pthread_mutex_lock(&sampler_lock);
+    if (sampler_running) {
+        __atomic_store_n(&sampler_stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(sampler_thread, NULL);
+        __atomic_store_n(&sampler_running, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sampler_lock);
+}
+
+int cad_sampler_running(void)
+{
+    return __atomic_load_n(&sampler_running, __ATOMIC_ACQUIRE);
+}
+
+uint8_t pifacecad_sampler_switches(void)
+{
+    return __atomic_load_n(&cur_switches, __ATOMIC_ACQUIRE);
+}
+
+size_t pifacecad_sampler_read(uint64_t * cursor,
+                              struct pifacecad_switch_sample * samples,
+                              size_t max)
+{
+    const uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+
+    // skip anything which has already been overwritten
+    if (head - *cursor > PIFACECAD_SAMPLER_RING_LEN) {
+        *cursor = head - PIFACECAD_SAMPLER_RING_LEN;
+    }
+
+    size_t num = 0;
+    while (num < max && *cursor < head) {
+        struct sampler_slot * slot = \
+            &ring[*cursor % PIFACECAD_SAMPLER_RING_LEN];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != *cursor + 1) {
+            (*cursor)++; // being overwritten under us, lost it
+            continue;
+        }
+        samples[num] = slot->sample;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == *cursor + 1) {
+            num++;
+        }
+        (*cursor)++;
+    }
+    return num;
+}
+
+int pifacecad_sampler_event_fd(void)
+{
+    if (event_fd < 0) {
+        __atomic_store_n(&event_fd,
+                         eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                         __ATOMIC_RELEASE);
+    }
+    return event_fd;
+}
+
+uint64_t pifacecad_sampler_head(void)
+{
+    return __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+}
+
+static void * sampler_worker(void * arg)
+{
+    (void) arg;
+    const uint8_t regs[] = {INTFA, INTCAPA, GPIOA};
+    uint8_t values[3];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!__atomic_load_n(&sampler_stopping, __ATOMIC_ACQUIRE)) {
+        next.tv_nsec += sampler_period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        cad_read_regs(regs, values, 3);
+        const uint64_t now = cad_now_ns();
+        const uint8_t last = pifacecad_sampler_switches();
+
+        // a press and release between two samples only shows up in the
+        // interrupt capture register
+        if (values[0] && values[1] != last && values[1] != values[2]) {
+            sampler_push(now, values[1]);
+        }
+        if (values[2] != pifacecad_sampler_switches()) {
+            sampler_push(now, values[2]);
+        }
+    }
+    return NULL;
+}
+
+/* single producer: only the sampler thread (or start, before it runs) */
+static void sampler_push(uint64_t timestamp_ns, uint8_t switches)
+{
+    const uint64_t seq = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    struct sampler_slot * slot = &ring[seq % PIFACECAD_SAMPLER_RING_LEN];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->sample.timestamp_ns = timestamp_ns;
+    slot->sample.changed = switches ^ pifacecad_sampler_switches();
+    slot->sample.switches = switches;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&cur_switches, switches, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring_head, seq + 1, __ATOMIC_RELEASE);
+    cad_latency_switches(switches, timestamp_ns);
+
+    const int fd = __atomic_load_n(&event_fd, __ATOMIC_ACQUIRE);
+    if (fd >= 0) {
+        const uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) < 0) {
+            // counter is saturated, the reader is already due to wake up
+        }
+    }
+}
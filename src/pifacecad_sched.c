@@ -0,0 +1,300 @@
+/**
+ * @file  pifacecad_sched.c
+ * @brief Priority scheduled LCD updates for PiFace Control and Display.
+ *
+ * Updates are kept per character cell (and per half custom bitmap) at
+ * the priority they were queued with, and sent on the worker thread (see
+ * pifacecad_rt.c) one small unit at a time: up to SCHED_UNIT_LEN
+ * neighbouring cells or four bitmap rows, highest priority first. A
+ * newer update to a cell drops anything still queued for it at the same
+ * or a lower priority, so an urgent message waits for at most one unit.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define ROW_WIDTH (LCD_RAM_WIDTH / LCD_MAX_LINES)
+#define SCHED_UNIT_LEN 4 // cells per unit of work
+#define CGRAM_HALF_ROWS 4 // bitmap rows per unit of work
+
+struct sched_unit {
+    int cgram; // else characters
+    uint8_t address; // DDRAM address, or location * 8 + first row
+    uint8_t len;
+    uint8_t data[SCHED_UNIT_LEN > CGRAM_HALF_ROWS ? \
+                 SCHED_UNIT_LEN : CGRAM_HALF_ROWS];
+};
+
+// queued content per priority, guarded by sched_lock
+static int16_t cells[PIFACECAD_NUM_PRIORITIES][LCD_RAM_WIDTH]; // -1: none
+static uint8_t cgram[PIFACECAD_NUM_PRIORITIES][8][8];
+static uint8_t cgram_halves[PIFACECAD_NUM_PRIORITIES][8]; // bit per half
+static int pending = 0; // cells and bitmap halves queued
+
+static int sched_open = 0;
+static int in_flight = 0; // sched_job is on the worker's queue
+static struct cad_job sched_job;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_idle = PTHREAD_COND_INITIALIZER;
+
+
+// static function definitions
+static int sched_take(struct sched_unit * unit);
+static void sched_send(const struct sched_unit * unit);
+static void sched_kick(void);
+static void sched_run(void * arg);
+static void sched_complete(struct cad_job * job);
+
+
+int pifacecad_sched_open(void)
+{
+    pthread_mutex_lock(&sched_lock);
+    if (sched_open) {
+        pthread_mutex_unlock(&sched_lock);
+        return 0;
+    }
+    // use the real-time worker if there is one, else a plain worker
+    if (cad_rt_acquire() < 0) {
+        pthread_mutex_unlock(&sched_lock);
+        return -1;
+    }
+    memset(cells, 0xff, sizeof(cells));
+    memset(cgram_halves, 0, sizeof(cgram_halves));
+    pending = 0;
+    in_flight = 0;
+    sched_open = 1;
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+void pifacecad_sched_close(void)
+{
+    pifacecad_sched_wait();
+    pthread_mutex_lock(&sched_lock);
+    if (!sched_open) {
+        pthread_mutex_unlock(&sched_lock);
+        return;
+    }
+    sched_open = 0;
+    pthread_mutex_unlock(&sched_lock);
+    cad_rt_release();
+}
+
+int pifacecad_sched_write(uint8_t col,
+                          uint8_t row,
+                          const char * message,
+                          size_t len,
+                          int priority)
+{
+    if (priority < 0 || priority >= PIFACECAD_NUM_PRIORITIES) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&sched_lock);
+    if (!sched_open) {
+        pthread_mutex_unlock(&sched_lock);
+        errno = ENODEV;
+        return -1;
+    }
+    col = col < ROW_WIDTH ? col : ROW_WIDTH - 1;
+    row = row < LCD_MAX_LINES ? row : LCD_MAX_LINES - 1;
+    size_t i;
+    int p;
+    for (i = 0; i < len; i++) {
+        if (message[i] == '\n') {
+            col = 0;
+            row = 1;
+            continue;
+        }
+        if (col >= ROW_WIDTH) {
+            col = 0; // end of a row carries on to the start of the next
+            row = (row + 1) % LCD_MAX_LINES;
+        }
+        const int cell = row * ROW_WIDTH + col;
+        for (p = 0; p <= priority; p++) {
+            if (cells[p][cell] >= 0) {
+                cells[p][cell] = -1; // superseded
+                pending--;
+            }
+        }
+        cells[priority][cell] = (uint8_t) message[i];
+        pending++;
+        col++;
+    }
+    sched_kick();
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+int pifacecad_sched_store_custom_bitmap(uint8_t location,
+                                        const uint8_t bitmap[],
+                                        int priority)
+{
+    if (priority < 0 || priority >= PIFACECAD_NUM_PRIORITIES) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&sched_lock);
+    if (!sched_open) {
+        pthread_mutex_unlock(&sched_lock);
+        errno = ENODEV;
+        return -1;
+    }
+    location &= 0x7;
+    int p;
+    for (p = 0; p <= priority; p++) {
+        pending -= __builtin_popcount(cgram_halves[p][location]);
+        cgram_halves[p][location] = 0;
+    }
+    memcpy(cgram[priority][location], bitmap, 8);
+    cgram_halves[priority][location] = 0x3;
+    pending += 2;
+    sched_kick();
+    pthread_mutex_unlock(&sched_lock);
+    return 0;
+}
+
+int pifacecad_sched_pending(void)
+{
+    pthread_mutex_lock(&sched_lock);
+    const int num = pending;
+    pthread_mutex_unlock(&sched_lock);
+    return num;
+}
+
+void pifacecad_sched_wait(void)
+{
+    struct sched_unit unit;
+    pthread_mutex_lock(&sched_lock);
+    while (pending > 0 || in_flight) {
+        if (!in_flight) {
+            sched_kick();
+        }
+        if (!in_flight && sched_take(&unit)) {
+            // the worker is gone or busy with a full queue, do it here
+            pthread_mutex_unlock(&sched_lock);
+            sched_send(&unit);
+            pthread_mutex_lock(&sched_lock);
+            continue;
+        }
+        if (in_flight) {
+            pthread_cond_wait(&sched_idle, &sched_lock);
+        }
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/* removes the most urgent unit of work from the queue, returns 0 if
+ * there is none (called with sched_lock held) */
+static int sched_take(struct sched_unit * unit)
+{
+    int p, i;
+    for (p = PIFACECAD_NUM_PRIORITIES - 1; p >= 0; p--) {
+        // glyphs first, so that characters never show old ones
+        for (i = 0; i < 8; i++) {
+            if (cgram_halves[p][i]) {
+                const int half = cgram_halves[p][i] & 1 ? 0 : 1;
+                unit->cgram = 1;
+                unit->address = i * 8 + half * CGRAM_HALF_ROWS;
+                unit->len = CGRAM_HALF_ROWS;
+                memcpy(unit->data,
+                       &cgram[p][i][half * CGRAM_HALF_ROWS],
+                       CGRAM_HALF_ROWS);
+                cgram_halves[p][i] &= ~(1 << half);
+                pending--;
+                return 1;
+            }
+        }
+        for (i = 0; i < LCD_RAM_WIDTH; i++) {
+            if (cells[p][i] < 0) {
+                continue;
+            }
+            const int row = i / ROW_WIDTH;
+            unit->cgram = 0;
+            unit->address = colrow2address(i % ROW_WIDTH, row);
+            unit->len = 0;
+            while (unit->len < SCHED_UNIT_LEN && \
+                    i < (row + 1) * ROW_WIDTH && cells[p][i] >= 0) {
+                unit->data[unit->len++] = cells[p][i];
+                cells[p][i++] = -1;
+                pending--;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void sched_send(const struct sched_unit * unit)
+{
+    if (unit->cgram) {
+        cad_lcd_cgram_write(unit->address >> 3,
+                            unit->address & 0x7,
+                            unit->data,
+                            unit->len);
+    } else {
+        const struct pifacecad_lcd_segment segment = {
+            address2col(unit->address),
+            address2row(unit->address),
+            (const char *) unit->data,
+            unit->len,
+        };
+        pifacecad_lcd_writev(&segment, 1);
+    }
+}
+
+/* puts the scheduler's job on the worker if there is something to do
+ * and it isn't there already (called with sched_lock held) */
+static void sched_kick(void)
+{
+    if (in_flight || pending == 0) {
+        return;
+    }
+    sched_job.func = sched_run;
+    sched_job.arg = NULL;
+    sched_job.complete = sched_complete;
+    if (cad_rt_submit(&sched_job) == 0) {
+        in_flight = 1;
+    }
+    // else pifacecad_sched_wait or the next update will try again
+}
+
+/* one unit per job, so that other work on the worker queue and newly
+ * queued urgent updates get a look in between units */
+static void sched_run(void * arg)
+{
+    (void) arg;
+    struct sched_unit unit;
+    pthread_mutex_lock(&sched_lock);
+    const int found = sched_take(&unit);
+    pthread_mutex_unlock(&sched_lock);
+    if (found) {
+        sched_send(&unit);
+    }
+}
+
+static void sched_complete(struct cad_job * job)
+{
+    (void) job;
+    pthread_mutex_lock(&sched_lock);
+    in_flight = 0;
+    sched_kick();
+    pthread_cond_broadcast(&sched_idle);
+    pthread_mutex_unlock(&sched_lock);
+}
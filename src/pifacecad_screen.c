@@ -0,0 +1,261 @@
+/**
+ * @file  pifacecad_screen.c
+ * @brief Virtual screens for PiFace Control and Display.
+ *
+ * Each screen is an off-screen copy of everything the HD44780 shows:
+ * DDRAM, CGRAM, cursor and display control. Showing a screen sends only
+ * what differs from the library's copy of the controller state.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define ROW_WIDTH (LCD_RAM_WIDTH / LCD_MAX_LINES)
+
+struct screen {
+    int used;
+    uint8_t ddram[LCD_RAM_WIDTH]; // col + row * 40, like the controller
+    uint8_t cgram[8 * 8];
+    uint8_t cgram_stored; // bit per location the screen has a bitmap for
+    uint8_t cursor_address;
+    uint8_t display_control;
+};
+
+// all guarded by the LCD lock (cad_lock)
+static struct screen screens[PIFACECAD_MAX_SCREENS];
+static int showing = -1;
+
+
+// static function definitions
+static struct screen * screen_get(int screen);
+static void screen_reset(struct screen * scr);
+static void screen_sync(const struct screen * scr);
+static int ram_index(uint8_t address);
+
+
+int pifacecad_screen_clear(int screen)
+{
+    cad_lock();
+    struct screen * scr = screen_get(screen);
+    if (scr == NULL) {
+        cad_unlock();
+        return -1;
+    }
+    screen_reset(scr);
+    if (screen == showing) {
+        screen_sync(scr);
+    }
+    cad_unlock();
+    return 0;
+}
+
+int pifacecad_screen_write(int screen,
+                           uint8_t col,
+                           uint8_t row,
+                           const char * message,
+                           size_t len)
+{
+    cad_lock();
+    struct screen * scr = screen_get(screen);
+    if (scr == NULL) {
+        cad_unlock();
+        return -1;
+    }
+    col = col < ROW_WIDTH ? col : ROW_WIDTH - 1;
+    row = row < LCD_MAX_LINES ? row : LCD_MAX_LINES - 1;
+    uint8_t address = colrow2address(col, row);
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (message[i] == '\n') {
+            address = colrow2address(0, 1);
+            continue;
+        }
+        scr->ddram[ram_index(address)] = message[i];
+        // the end of a row carries on to the start of the next
+        address++;
+        if (address == ROW_OFFSETS[0] + ROW_WIDTH) {
+            address = ROW_OFFSETS[1];
+        } else if (address == ROW_OFFSETS[1] + ROW_WIDTH) {
+            address = ROW_OFFSETS[0];
+        }
+    }
+    scr->cursor_address = address;
+    if (screen == showing) {
+        screen_sync(scr);
+    }
+    cad_unlock();
+    return address;
+}
+
+int pifacecad_screen_store_custom_bitmap(int screen,
+                                         uint8_t location,
+                                         const uint8_t bitmap[])
+{
+    cad_lock();
+    struct screen * scr = screen_get(screen);
+    if (scr == NULL) {
+        cad_unlock();
+        return -1;
+    }
+    location &= 0x7;
+    memcpy(&scr->cgram[location * 8], bitmap, 8);
+    scr->cgram_stored |= 1 << location;
+    if (screen == showing) {
+        screen_sync(scr);
+    }
+    cad_unlock();
+    return 0;
+}
+
+int pifacecad_screen_set_cursor(int screen,
+                                uint8_t col,
+                                uint8_t row,
+                                uint8_t display_control)
+{
+    cad_lock();
+    struct screen * scr = screen_get(screen);
+    if (scr == NULL) {
+        cad_unlock();
+        return -1;
+    }
+    col = col < ROW_WIDTH ? col : ROW_WIDTH - 1;
+    row = row < LCD_MAX_LINES ? row : LCD_MAX_LINES - 1;
+    scr->cursor_address = colrow2address(col, row);
+    scr->display_control = display_control & \
+        (LCD_DISPLAYON | LCD_CURSORON | LCD_BLINKON);
+    if (screen == showing) {
+        screen_sync(scr);
+    }
+    cad_unlock();
+    return 0;
+}
+
+int pifacecad_screen_show(int screen)
+{
+    cad_lock();
+    struct screen * scr = screen_get(screen);
+    if (scr == NULL) {
+        cad_unlock();
+        return -1;
+    }
+    screen_sync(scr);
+    showing = screen;
+    cad_unlock();
+    return 0;
+}
+
+int pifacecad_screen_showing(void)
+{
+    cad_lock();
+    const int screen = showing;
+    cad_unlock();
+    return screen;
+}
+
+static struct screen * screen_get(int screen)
+{
+    if (screen < 0 || screen >= PIFACECAD_MAX_SCREENS) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct screen * scr = &screens[screen];
+    if (!scr->used) {
+        screen_reset(scr);
+    }
+    return scr;
+}
+
+static void screen_reset(struct screen * scr)
+{
+    memset(scr, 0, sizeof(*scr));
+    memset(scr->ddram, ' ', sizeof(scr->ddram));
+    scr->display_control = LCD_DISPLAYON;
+    scr->used = 1;
+}
+
+/* makes the LCD match scr, sending only the differences */
+static void screen_sync(const struct screen * scr)
+{
+    struct pifacecad_display_snapshot panel;
+    cad_lcd_snapshot(&panel);
+
+    // glyphs first, so that new characters never show old glyphs
+    uint8_t bitmap[8];
+    int moved = 0; // the address counter is no longer where panel has it
+    int i;
+    for (i = 0; i < 8; i++) {
+        if (!(scr->cgram_stored & (1 << i))) {
+            continue; // the screen doesn't use it
+        }
+        if (cad_lcd_cgram_get(i, bitmap) < 0 || \
+                memcmp(bitmap, &scr->cgram[i * 8], 8) != 0) {
+            memcpy(bitmap, &scr->cgram[i * 8], 8);
+            pifacecad_lcd_store_custom_bitmap(i, bitmap);
+            moved = 1;
+        }
+    }
+
+    // screens aren't shifted
+    if (panel.display_shift != 0) {
+        pifacecad_lcd_home();
+        moved = 1;
+    }
+
+    // changed runs of characters, carrying on through single unchanged
+    // characters since they cost less than a set address command
+    struct cad_lcd_run runs[LCD_RAM_WIDTH / 2 + 1];
+    int num = 0;
+    int row;
+    for (row = 0; row < LCD_MAX_LINES; row++) {
+        const uint8_t * want = &scr->ddram[row * ROW_WIDTH];
+        const uint8_t * have = &panel.ddram[row * ROW_WIDTH];
+        int col = 0;
+        while (col < ROW_WIDTH) {
+            if (want[col] == have[col]) {
+                col++;
+                continue;
+            }
+            int end = col + 1;
+            while (end < ROW_WIDTH && (want[end] != have[end] || \
+                    (end + 1 < ROW_WIDTH && want[end + 1] != have[end + 1]))) {
+                end++;
+            }
+            runs[num].address = colrow2address(col, row);
+            runs[num].buf = &want[col];
+            runs[num].len = end - col;
+            num++;
+            col = end;
+        }
+    }
+
+    // an empty run puts the cursor back, at its DDRAM address (row 1
+    // starts at 0x40, so pifacecad_lcd_set_cursor_address would wrap it)
+    if (num > 0 || moved || panel.cursor_address != scr->cursor_address) {
+        runs[num].address = scr->cursor_address;
+        runs[num].buf = NULL;
+        runs[num].len = 0;
+        num++;
+        cad_lcd_write_runs(runs, num);
+    }
+    cad_lcd_set_display_control(scr->display_control);
+}
+
+static int ram_index(uint8_t address)
+{
+    return address2row(address) * ROW_WIDTH + address2col(address);
+}
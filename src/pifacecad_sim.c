@@ -0,0 +1,245 @@
+/**
+ * @file  pifacecad_sim.c
+ * @brief Simulated PiFace Control and Display.
+ *
+ * Stands in for the MCP23S17 so that the library can run without the
+ * hardware. Register writes are kept, the switch port is driven by a
+ * script of timed switch edges, in time order:
+ *
+ *     # ms switch edge
+ *     100 0 press
+ *     250 0 release
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <mcp23s17.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define SIM_NUM_REGS (OLATB + 1)
+#define SIM_MAX_LINE 128
+#define SIM_INTERRUPT_POLL_NS 1000000L // 1ms
+
+struct sim_event {
+    uint64_t at_ns; // since the simulation started
+    uint8_t switch_num;
+    uint8_t pressed;
+};
+
+static int sim_active = 0;
+static uint8_t regs[PIFACECAD_MAX_BOARDS][SIM_NUM_REGS];
+static struct sim_event * events = NULL;
+static int num_events = 0;
+static int next_event = 0;
+static uint64_t start_ns = 0;
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// static function definitions
+static void sim_play(void);
+static int sim_load(const char * script);
+
+
+int pifacecad_sim_open(const char * script)
+{
+    pthread_mutex_lock(&sim_lock);
+    memset(regs, 0, sizeof(regs));
+    int i;
+    for (i = 0; i < PIFACECAD_MAX_BOARDS; i++) {
+        regs[i][IODIRA] = regs[i][IODIRB] = 0xff; // power on state
+        regs[i][GPIOA] = 0xff; // nothing pressed (pulled up)
+    }
+    free(events);
+    events = NULL;
+    num_events = next_event = 0;
+    if (script != NULL && sim_load(script) < 0) {
+        pthread_mutex_unlock(&sim_lock);
+        return -1;
+    }
+    start_ns = cad_now_ns();
+    __atomic_store_n(&sim_active, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&sim_lock);
+    return 0;
+}
+
+void pifacecad_sim_close(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    __atomic_store_n(&sim_active, 0, __ATOMIC_RELEASE);
+    free(events);
+    events = NULL;
+    num_events = next_event = 0;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int pifacecad_sim_done(void)
+{
+    pthread_mutex_lock(&sim_lock);
+    const int done = next_event >= num_events;
+    pthread_mutex_unlock(&sim_lock);
+    return done;
+}
+
+void pifacecad_sim_set_switch(uint8_t switch_num, uint8_t pressed)
+{
+    pthread_mutex_lock(&sim_lock);
+    int i;
+    for (i = 0; i < PIFACECAD_MAX_BOARDS; i++) {
+        const uint8_t before = regs[i][GPIOA];
+        if (pressed) {
+            regs[i][GPIOA] &= 0xff ^ (1 << switch_num); // active low
+        } else {
+            regs[i][GPIOA] |= 1 << switch_num;
+        }
+        // interrupt on change, captured until GPIOA/INTCAPA is read
+        const uint8_t changed = (before ^ regs[i][GPIOA]) & regs[i][GPINTENA];
+        if (changed && !regs[i][INTFA]) {
+            regs[i][INTCAPA] = regs[i][GPIOA];
+        }
+        regs[i][INTFA] |= changed;
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+int cad_sim_active(void)
+{
+    return __atomic_load_n(&sim_active, __ATOMIC_ACQUIRE);
+}
+
+uint8_t cad_sim_read_reg(uint8_t reg, uint8_t addr)
+{
+    addr %= PIFACECAD_MAX_BOARDS;
+    sim_play();
+    pthread_mutex_lock(&sim_lock);
+    uint8_t value = 0;
+    if (reg < SIM_NUM_REGS) {
+        value = regs[addr][reg];
+        if (reg == GPIOA || reg == INTCAPA) {
+            regs[addr][INTFA] = 0; // reading clears the interrupt
+        }
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return value;
+}
+
+void cad_sim_write_reg(uint8_t data, uint8_t reg, uint8_t addr)
+{
+    addr %= PIFACECAD_MAX_BOARDS;
+    pthread_mutex_lock(&sim_lock);
+    if (reg == GPIOB || reg == OLATB) {
+        regs[addr][GPIOB] = regs[addr][OLATB] = data;
+    } else if (reg < SIM_NUM_REGS && reg != GPIOA && reg != INTFA && \
+            reg != INTCAPA) {
+        regs[addr][reg] = data; // GPIOA and the interrupt flags are ours
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+/* waits like mcp23s17_wait_for_interrupt, for INTFA to be set: returns 1
+ * when it is, 0 on timeout */
+int cad_sim_wait_for_interrupt(uint8_t addr, int timeout_ms)
+{
+    addr %= PIFACECAD_MAX_BOARDS;
+    const uint64_t deadline = cad_now_ns() + timeout_ms * 1000000ULL;
+    const struct timespec tick = {0, SIM_INTERRUPT_POLL_NS};
+    while (1) {
+        sim_play();
+        pthread_mutex_lock(&sim_lock);
+        const uint8_t flags = regs[addr][INTFA];
+        pthread_mutex_unlock(&sim_lock);
+        if (flags) {
+            return 1;
+        }
+        if (timeout_ms >= 0 && cad_now_ns() >= deadline) {
+            return 0;
+        }
+        nanosleep(&tick, NULL);
+    }
+}
+
+/* apply every scripted edge which is due */
+static void sim_play(void)
+{
+    const uint64_t now = cad_now_ns() - start_ns;
+    while (1) {
+        pthread_mutex_lock(&sim_lock);
+        if (next_event >= num_events || events[next_event].at_ns > now) {
+            pthread_mutex_unlock(&sim_lock);
+            return;
+        }
+        const struct sim_event event = events[next_event++];
+        pthread_mutex_unlock(&sim_lock);
+        pifacecad_sim_set_switch(event.switch_num, event.pressed);
+    }
+}
+
+static int sim_load(const char * script)
+{
+    FILE * file = fopen(script, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[SIM_MAX_LINE];
+    int line_num = 0, capacity = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        char * hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        unsigned long ms;
+        unsigned int switch_num;
+        char edge[16];
+        const int fields = sscanf(line, "%lu %u %15s", &ms, &switch_num, edge);
+        if (fields <= 0) {
+            continue; // blank or comment
+        }
+        if (fields != 3 || switch_num > 7 || \
+                (strcmp(edge, "press") != 0 && strcmp(edge, "release") != 0)) {
+            fprintf(stderr,
+                    "pifacecad: %s:%d: expected 'MS SWITCH press|release'\n",
+                    script,
+                    line_num);
+            fclose(file);
+            errno = EINVAL;
+            return -1;
+        }
+        if (num_events > 0 && ms * 1000000ULL < events[num_events - 1].at_ns) {
+            fprintf(stderr,
+                    "pifacecad: %s:%d: events must be in time order\n",
+                    script,
+                    line_num);
+            fclose(file);
+            errno = EINVAL;
+            return -1;
+        }
+        if (num_events == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            events = realloc(events, capacity * sizeof(struct sim_event));
+        }
+        events[num_events].at_ns = ms * 1000000ULL;
+        events[num_events].switch_num = switch_num;
+        events[num_events].pressed = strcmp(edge, "press") == 0;
+        num_events++;
+    }
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,205 @@
+/**
+ * @file  pifacecad_sprite.c
+ * @brief Custom bitmap animation for PiFace Control and Display.
+ *
+ * A sprite is a list of 5x8 frames bound to one custom bitmap location.
+ * The HD44780 redraws every character showing that location as soon as
+ * its bitmap changes, so a sprite is animated by rewriting only the
+ * bitmap rows which differ from the next frame, however many times it
+ * appears on the screen.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define SPRITE_IDLE_NS 100000000L // timer wakeup with nothing to animate
+
+static struct pifacecad_sprite * sprites[8]; // one per custom bitmap
+static pthread_mutex_t sprite_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sprite_cond = PTHREAD_COND_INITIALIZER; // see start
+static pthread_t sprite_thread;
+static int sprite_running = 0;
+static int sprite_stopping = 0;
+
+
+// static function definitions
+static void sprite_upload(struct pifacecad_sprite * sprite);
+static void * sprite_timer(void * arg);
+
+
+int pifacecad_sprite_add(struct pifacecad_sprite * sprite,
+                         uint8_t location,
+                         const uint8_t (*frames)[8],
+                         int num_frames,
+                         unsigned int interval_ms)
+{
+    if (num_frames < 1 || interval_ms == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    sprite->location = location & 0x7;
+    sprite->frames = frames;
+    sprite->num_frames = num_frames;
+    sprite->frame = 0;
+    sprite->interval_ns = interval_ms * 1000000ULL;
+    sprite->next_ns = cad_now_ns() + sprite->interval_ns;
+
+    pthread_mutex_lock(&sprite_lock);
+    sprites[sprite->location] = sprite;
+    sprite_upload(sprite);
+    pthread_cond_signal(&sprite_cond); // timer may need to wake earlier
+    pthread_mutex_unlock(&sprite_lock);
+    return 0;
+}
+
+void pifacecad_sprite_remove(struct pifacecad_sprite * sprite)
+{
+    pthread_mutex_lock(&sprite_lock);
+    if (sprites[sprite->location] == sprite) {
+        sprites[sprite->location] = NULL;
+    }
+    pthread_mutex_unlock(&sprite_lock);
+}
+
+uint64_t pifacecad_sprite_tick(void)
+{
+    const uint64_t now = cad_now_ns();
+    uint64_t next = now + SPRITE_IDLE_NS;
+
+    pthread_mutex_lock(&sprite_lock);
+    cad_lock(); // all due sprites change together
+    int i;
+    for (i = 0; i < 8; i++) {
+        struct pifacecad_sprite * sprite = sprites[i];
+        if (sprite == NULL) {
+            continue;
+        }
+        if (sprite->next_ns <= now) {
+            sprite->frame = (sprite->frame + 1) % sprite->num_frames;
+            sprite_upload(sprite);
+            // stay on the grid, skip frames we were too late for
+            do {
+                sprite->next_ns += sprite->interval_ns;
+            } while (sprite->next_ns <= now);
+        }
+        if (sprite->next_ns < next) {
+            next = sprite->next_ns;
+        }
+    }
+    cad_unlock();
+    pthread_mutex_unlock(&sprite_lock);
+    return next;
+}
+
+int pifacecad_sprite_start(void)
+{
+    pthread_mutex_lock(&sprite_lock);
+    if (sprite_running) {
+        pthread_mutex_unlock(&sprite_lock);
+        return 0;
+    }
+    sprite_stopping = 0;
+
+    // the timer sleeps until CLOCK_MONOTONIC deadlines
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_destroy(&sprite_cond);
+    pthread_cond_init(&sprite_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    int ret = pthread_create(&sprite_thread, NULL, sprite_timer, NULL);
+    if (ret != 0) {
+        pthread_mutex_unlock(&sprite_lock);
+        errno = ret;
+        return -1;
+    }
+    sprite_running = 1;
+    pthread_mutex_unlock(&sprite_lock);
+    return 0;
+}
+
+void pifacecad_sprite_stop(void)
+{
+    pthread_mutex_lock(&sprite_lock);
+    if (!sprite_running || sprite_stopping) {
+        pthread_mutex_unlock(&sprite_lock);
+        return; // not running, or someone else is stopping it
+    }
+    sprite_stopping = 1;
+    pthread_cond_signal(&sprite_cond);
+    pthread_mutex_unlock(&sprite_lock);
+
+    pthread_join(sprite_thread, NULL);
+    pthread_mutex_lock(&sprite_lock);
+    sprite_running = 0;
+    pthread_mutex_unlock(&sprite_lock);
+}
+
+/* Sends only the rows of the sprite's current frame which differ from
+ * what the controller already has, each run of rows as one batch.
+ * Called with sprite_lock held. */
+static void sprite_upload(struct pifacecad_sprite * sprite)
+{
+    const uint8_t * frame = sprite->frames[sprite->frame];
+    uint8_t current[8];
+
+    cad_lock();
+    const int known = cad_lcd_cgram_get(sprite->location, current) == 0;
+    int row = 0;
+    while (row < 8) {
+        if (known && current[row] == frame[row]) {
+            row++;
+            continue;
+        }
+        const int first = row;
+        while (row < 8 && (!known || current[row] != frame[row])) {
+            row++;
+        }
+        cad_lcd_cgram_write(sprite->location,
+                            first,
+                            frame + first,
+                            row - first);
+    }
+    cad_unlock();
+}
+
+static void * sprite_timer(void * arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&sprite_lock);
+    while (!sprite_stopping) {
+        pthread_mutex_unlock(&sprite_lock);
+        const uint64_t next = pifacecad_sprite_tick();
+        pthread_mutex_lock(&sprite_lock);
+
+        struct timespec until;
+        until.tv_sec = next / 1000000000ULL;
+        until.tv_nsec = next % 1000000000ULL;
+        while (!sprite_stopping && cad_now_ns() < next) {
+            if (pthread_cond_timedwait(&sprite_cond,
+                                       &sprite_lock,
+                                       &until) == 0) {
+                break; // sprites changed, work out the next wakeup again
+            }
+        }
+    }
+    pthread_mutex_unlock(&sprite_lock);
+    return NULL;
+}
@@ -0,0 +1,229 @@
+/**
+ * @file  pifacecad_uinput.c
+ * @brief Switches as a Linux input device for PiFace Control and Display.
+ *
+ * A thread follows the switch sampler's ring and turns each change into
+ * key events on a /dev/uinput virtual keyboard, so that other programs
+ * can read the switches through evdev without touching the SPI bus.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <linux/uinput.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define UINPUT_DEVICE "/dev/uinput"
+#define UINPUT_SAMPLES 16 // read from the sampler ring at a time
+#define UINPUT_POLL_MS 100 // in case someone else drains the sampler's fd
+
+static const uint16_t default_keymap[PIFACECAD_NUM_SWITCHES] = {
+    KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_ENTER, KEY_LEFT, KEY_RIGHT,
+};
+
+static uint16_t keymap[PIFACECAD_NUM_SWITCHES];
+static int uinput_fd = -1;
+static int stop_fd = -1;
+static int started_sampler = 0;
+static pthread_t uinput_thread;
+
+
+// static function definitions
+static int uinput_create(const char * name);
+static void * uinput_worker(void * arg);
+static void uinput_emit(uint16_t type, uint16_t code, int32_t value);
+
+
+int pifacecad_uinput_start(const char * name,
+                           const uint16_t * keys,
+                           unsigned int rate_hz)
+{
+    if (uinput_fd >= 0 || cad_group_active()) {
+        errno = EBUSY; // the sampler is not available to a group
+        return -1;
+    }
+    memcpy(keymap,
+           keys != NULL ? keys : default_keymap,
+           sizeof(keymap));
+    if ((uinput_fd = uinput_create(name)) < 0) {
+        return -1;
+    }
+    if ((stop_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        goto err_uinput;
+    }
+
+    started_sampler = 0;
+    if (pifacecad_sampler_start(rate_hz) == 0) {
+        started_sampler = 1;
+    } else if (errno != EBUSY) {
+        goto err_stop_fd;
+    }
+    if (pifacecad_sampler_event_fd() < 0) {
+        goto err_sampler;
+    }
+
+    int ret = pthread_create(&uinput_thread, NULL, uinput_worker, NULL);
+    if (ret != 0) {
+        errno = ret;
+        goto err_sampler;
+    }
+    return uinput_fd;
+
+err_sampler:
+    if (started_sampler) {
+        pifacecad_sampler_stop();
+    }
+err_stop_fd:
+    close(stop_fd);
+    stop_fd = -1;
+err_uinput:
+    ioctl(uinput_fd, UI_DEV_DESTROY);
+    close(uinput_fd);
+    uinput_fd = -1;
+    return -1;
+}
+
+void pifacecad_uinput_stop(void)
+{
+    if (uinput_fd < 0) {
+        return;
+    }
+    const uint64_t one = 1;
+    if (write(stop_fd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join(uinput_thread, NULL);
+    }
+    if (started_sampler) {
+        pifacecad_sampler_stop();
+    }
+    close(stop_fd);
+    stop_fd = -1;
+    ioctl(uinput_fd, UI_DEV_DESTROY);
+    close(uinput_fd);
+    uinput_fd = -1;
+}
+
+static int uinput_create(const char * name)
+{
+    const int fd = open(UINPUT_DEVICE, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0) {
+        goto err;
+    }
+    int i;
+    for (i = 0; i < PIFACECAD_NUM_SWITCHES; i++) {
+        if (keymap[i] != 0 && ioctl(fd, UI_SET_KEYBIT, keymap[i]) < 0) {
+            goto err;
+        }
+    }
+
+    struct uinput_setup setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_SPI;
+    strncpy(setup.name,
+            name != NULL ? name : PIFACECAD_UINPUT_NAME,
+            UINPUT_MAX_NAME_SIZE - 1);
+    if (ioctl(fd, UI_DEV_SETUP, &setup) < 0) {
+        // kernels before 4.5 take the setup as a write
+        struct uinput_user_dev dev;
+        memset(&dev, 0, sizeof(dev));
+        dev.id = setup.id;
+        memcpy(dev.name, setup.name, sizeof(dev.name));
+        if (write(fd, &dev, sizeof(dev)) != sizeof(dev)) {
+            goto err;
+        }
+    }
+    if (ioctl(fd, UI_DEV_CREATE) < 0) {
+        goto err;
+    }
+    return fd;
+
+err:
+    close(fd);
+    return -1;
+}
+
+static void * uinput_worker(void * arg)
+{
+    (void) arg;
+    struct pollfd fds[2] = {
+        {pifacecad_sampler_event_fd(), POLLIN, 0},
+        {stop_fd, POLLIN, 0},
+    };
+    struct pifacecad_switch_sample samples[UINPUT_SAMPLES];
+    uint64_t cursor = pifacecad_sampler_head();
+    uint8_t down = ~pifacecad_sampler_switches(); // active low
+    uint64_t count;
+
+    while (!(fds[1].revents & POLLIN)) {
+        if (poll(fds, 2, UINPUT_POLL_MS) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[0].revents & POLLIN && \
+                read(fds[0].fd, &count, sizeof(count)) < 0) {
+            // someone else drained it, the ring is still there
+        }
+
+        size_t num, i;
+        while ((num = pifacecad_sampler_read(&cursor, samples,
+                                             UINPUT_SAMPLES)) > 0) {
+            for (i = 0; i < num; i++) {
+                const uint8_t pressed = ~samples[i].switches;
+                const uint8_t changed = pressed ^ down;
+                int sw, report = 0;
+                for (sw = 0; sw < PIFACECAD_NUM_SWITCHES; sw++) {
+                    if ((changed >> sw) & 1 && keymap[sw] != 0) {
+                        uinput_emit(EV_KEY, keymap[sw], (pressed >> sw) & 1);
+                        report = 1;
+                    }
+                }
+                if (report) {
+                    uinput_emit(EV_SYN, SYN_REPORT, 0);
+                }
+                down = pressed;
+            }
+        }
+    }
+
+    // don't leave keys held down
+    int sw;
+    for (sw = 0; sw < PIFACECAD_NUM_SWITCHES; sw++) {
+        if ((down >> sw) & 1 && keymap[sw] != 0) {
+            uinput_emit(EV_KEY, keymap[sw], 0);
+        }
+    }
+    uinput_emit(EV_SYN, SYN_REPORT, 0);
+    return NULL;
+}
+
+static void uinput_emit(uint16_t type, uint16_t code, int32_t value)
+{
+    struct input_event event;
+    memset(&event, 0, sizeof(event)); // the kernel fills in the time
+    event.type = type;
+    event.code = code;
+    event.value = value;
+    if (write(uinput_fd, &event, sizeof(event)) < 0) {
+        // nobody can act on a lost key event, carry on
+    }
+}
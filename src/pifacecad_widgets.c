@@ -0,0 +1,199 @@
+/**
+ * @file  pifacecad_widgets.c
+ * @brief Bar graph widgets for PiFace Control and Display.
+ *
+ * Bars are drawn with partially filled glyphs stored in CGRAM (5 steps
+ * per cell horizontally, 8 vertically). Glyphs are only uploaded when
+ * the LCD doesn't already hold them and updates only rewrite the cells
+ * which change.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include "pifacecad.h"
+#include "pifacecad_internal.h"
+
+#define HBAR_STEPS 5 // pixel columns per cell
+#define VBAR_STEPS 8 // pixel rows per cell
+#define CHAR_EMPTY ' '
+#define CHAR_FULL 0xff // solid block in the HD44780 A00 character ROM
+
+
+// static function definitions
+static void bargraph_install_glyphs(const struct pifacecad_bargraph * bar);
+static uint8_t bargraph_cell_char(const struct pifacecad_bargraph * bar,
+                                  unsigned int level,
+                                  uint8_t cell);
+static uint8_t bargraph_cell_address(const struct pifacecad_bargraph * bar,
+                                     uint8_t cell);
+
+
+int pifacecad_bargraph_init(struct pifacecad_bargraph * bar,
+                            uint8_t col,
+                            uint8_t row,
+                            uint8_t cells,
+                            uint8_t orientation,
+                            uint8_t first_slot)
+{
+    if (col >= LCD_RAM_WIDTH / 2 || row >= LCD_MAX_LINES) {
+        errno = EINVAL;
+        return -1;
+    }
+    bar->col = col;
+    bar->row = row;
+    bar->cells = cells;
+    bar->orientation = orientation;
+    bar->first_slot = first_slot & 0x7;
+    bar->level = 0;
+
+    // keep the bar in display RAM
+    const uint8_t max_cells = orientation == PIFACECAD_BAR_VERTICAL ? \
+        row + 1 : (LCD_RAM_WIDTH / 2) - col;
+    if (bar->cells > max_cells) {
+        bar->cells = max_cells;
+    }
+
+    bargraph_install_glyphs(bar);
+
+    // draw the empty bar in one batch
+    uint8_t empty[LCD_RAM_WIDTH / 2];
+    struct cad_lcd_run runs[LCD_MAX_LINES];
+    int num_runs = 0;
+    memset(empty, CHAR_EMPTY, sizeof(empty));
+    if (orientation == PIFACECAD_BAR_VERTICAL) {
+        uint8_t cell;
+        for (cell = 0; cell < bar->cells; cell++) {
+            runs[num_runs].address = bargraph_cell_address(bar, cell);
+            runs[num_runs].buf = empty;
+            runs[num_runs].len = 1;
+            num_runs++;
+        }
+    } else if (bar->cells > 0) {
+        runs[0].address = bargraph_cell_address(bar, 0);
+        runs[0].buf = empty;
+        runs[0].len = bar->cells;
+        num_runs = 1;
+    }
+    cad_lcd_write_runs(runs, num_runs);
+    return 0;
+}
+
+unsigned int pifacecad_bargraph_resolution(
+    const struct pifacecad_bargraph * bar)
+{
+    const unsigned int steps = \
+        bar->orientation == PIFACECAD_BAR_VERTICAL ? VBAR_STEPS : HBAR_STEPS;
+    return bar->cells * steps;
+}
+
+void pifacecad_bargraph_set(struct pifacecad_bargraph * bar,
+                            unsigned int value,
+                            unsigned int max)
+{
+    const unsigned int resolution = pifacecad_bargraph_resolution(bar);
+    if (max == 0) {
+        max = resolution;
+    }
+    if (value > max) {
+        value = max;
+    }
+    // round to the nearest step, a large max would overflow value * steps
+    const unsigned int level = \
+        ((uint64_t) value * resolution + max / 2) / max;
+    if (level == bar->level) {
+        return;
+    }
+
+    // only the cells between the old and new end of the bar change
+    uint8_t chars[LCD_RAM_WIDTH / 2];
+    struct cad_lcd_run runs[LCD_RAM_WIDTH / 2];
+    int num_runs = 0;
+    uint8_t cell;
+    for (cell = 0; cell < bar->cells; cell++) {
+        const uint8_t old_char = bargraph_cell_char(bar, bar->level, cell);
+        chars[cell] = bargraph_cell_char(bar, level, cell);
+        if (old_char == chars[cell]) {
+            continue;
+        }
+        // horizontal neighbours are consecutive addresses, send them as
+        // one run after a single set address
+        struct cad_lcd_run * last = num_runs > 0 ? &runs[num_runs - 1] : NULL;
+        if (bar->orientation == PIFACECAD_BAR_HORIZONTAL && last != NULL && \
+                last->buf + last->len == &chars[cell]) {
+            last->len++;
+            continue;
+        }
+        runs[num_runs].address = bargraph_cell_address(bar, cell);
+        runs[num_runs].buf = &chars[cell];
+        runs[num_runs].len = 1;
+        num_runs++;
+    }
+    cad_lcd_write_runs(runs, num_runs);
+    bar->level = level;
+}
+
+static void bargraph_install_glyphs(const struct pifacecad_bargraph * bar)
+{
+    uint8_t bitmap[8], stored[8];
+    const int vertical = bar->orientation == PIFACECAD_BAR_VERTICAL;
+    const int num_glyphs = vertical ? VBAR_STEPS - 1 : HBAR_STEPS - 1;
+    int i, row;
+    for (i = 0; i < num_glyphs; i++) {
+        const uint8_t slot = (bar->first_slot + i) & 0x7;
+        for (row = 0; row < 8; row++) {
+            if (vertical) {
+                // i + 1 rows filled from the bottom
+                bitmap[row] = row >= 8 - (i + 1) ? 0x1f : 0x00;
+            } else {
+                // i + 1 columns filled from the left
+                bitmap[row] = (0x1f << (HBAR_STEPS - (i + 1))) & 0x1f;
+            }
+        }
+        // the LCD state knows what is in CGRAM, whoever stored it
+        if (cad_lcd_cgram_get(slot, stored) == 0 && \
+                memcmp(stored, bitmap, sizeof(bitmap)) == 0) {
+            continue; // already there
+        }
+        pifacecad_lcd_store_custom_bitmap(slot, bitmap);
+    }
+}
+
+static uint8_t bargraph_cell_char(const struct pifacecad_bargraph * bar,
+                                  unsigned int level,
+                                  uint8_t cell)
+{
+    const unsigned int steps = \
+        bar->orientation == PIFACECAD_BAR_VERTICAL ? VBAR_STEPS : HBAR_STEPS;
+    const unsigned int cell_start = cell * steps;
+    if (level <= cell_start) {
+        return CHAR_EMPTY;
+    } else if (level >= cell_start + steps) {
+        return CHAR_FULL;
+    } else {
+        return (bar->first_slot + (level - cell_start) - 1) & 0x7;
+    }
+}
+
+/* horizontal bars grow right from (col, row), vertical bars grow up */
+static uint8_t bargraph_cell_address(const struct pifacecad_bargraph * bar,
+                                     uint8_t cell)
+{
+    if (bar->orientation == PIFACECAD_BAR_VERTICAL) {
+        return colrow2address(bar->col, bar->row - cell);
+    } else {
+        return colrow2address(bar->col + cell, bar->row);
+    }
+}
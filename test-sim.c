@@ -0,0 +1,734 @@
+/* Behaviour tests which run against a simulated board (no SPI).
+ *
+ *     make test-sim && ./test-sim
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pifacecad.h"
+
+#define TEST_MIRROR_NAME "/pifacecad-test-sim"
+#define TEST_STATE_NAME "/pifacecad-test-sim-state"
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+
+/* returns one row of the display as it is seen, after the display shift */
+static const char * visible_row(int row)
+{
+    static char text[LCD_WIDTH + 1];
+    struct pifacecad_display_snapshot snapshot;
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    int col;
+    for (col = 0; col < LCD_WIDTH; col++) {
+        text[col] = snapshot.ddram[row * 40 +
+                                   (snapshot.display_shift + col) % 40];
+    }
+    text[LCD_WIDTH] = '\0';
+    return text;
+}
+
+static void noop(void * arg)
+{
+}
+
+static void sleep_ms(long ms)
+{
+    const struct timespec time = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&time, NULL);
+}
+
+static void test_shared_state_seeded(void)
+{
+    pifacecad_lcd_set_cursor_address(0x45);
+    shm_unlink(TEST_STATE_NAME);
+    CHECK(pifacecad_shared_state_open(TEST_STATE_NAME) == 0);
+
+    // the new state carries on from this process's own
+    CHECK(pifacecad_lcd_get_cursor_address() == 0x45);
+
+    // and is not writable by everyone
+    struct stat st;
+    CHECK(stat("/dev/shm" TEST_STATE_NAME, &st) == 0);
+    CHECK((st.st_mode & 0007) == 0);
+
+    pifacecad_lcd_set_cursor_address(0x07);
+    pifacecad_shared_state_close();
+    CHECK(pifacecad_lcd_get_cursor_address() == 0x07);
+    shm_unlink(TEST_STATE_NAME);
+}
+
+static void record_thread(void * arg)
+{
+    *(pthread_t *) arg = pthread_self();
+}
+
+static void test_rt_worker(void)
+{
+    CHECK(pifacecad_rt_start(NULL) == 0);
+    errno = 0;
+    CHECK(pifacecad_rt_start(NULL) < 0);
+    CHECK(errno == EBUSY);
+
+    // jobs run on the worker, not the caller
+    pthread_t worker = pthread_self();
+    CHECK(pifacecad_rt_call(record_thread, &worker) == 0);
+    CHECK(!pthread_equal(worker, pthread_self()));
+
+    // and so do the LCD functions
+    pifacecad_lcd_clear();
+    pifacecad_lcd_write("rt worker");
+    CHECK(pifacecad_lcd_get_cursor_address() == 9);
+    CHECK(strncmp(visible_row(0), "rt worker", 9) == 0);
+    CHECK(pifacecad_rt_worst_latency_ns() > 0);
+    pifacecad_rt_stop();
+
+    // without a worker the job runs here
+    CHECK(pifacecad_rt_call(record_thread, &worker) == 0);
+    CHECK(pthread_equal(worker, pthread_self()));
+}
+
+static void * start_sampler(void * arg)
+{
+    *(int *) arg = pifacecad_sampler_start(1000);
+    return NULL;
+}
+
+static void test_sampler_ring(void)
+{
+    // only one of two racing starts gets the sampler
+    pthread_t threads[2];
+    int started[2];
+    int i;
+    for (i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, start_sampler, &started[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    CHECK((started[0] == 0) + (started[1] == 0) == 1);
+
+    uint64_t cursor = pifacecad_sampler_head();
+    pifacecad_sim_set_switch(2, 1);
+    sleep_ms(20);
+    pifacecad_sim_set_switch(2, 0);
+    sleep_ms(20);
+    pifacecad_sampler_stop();
+
+    struct pifacecad_switch_sample samples[8];
+    CHECK(pifacecad_sampler_read(&cursor, samples, 8) == 2);
+    CHECK(samples[0].changed == 0x04 && samples[0].switches == 0xfb);
+    CHECK(samples[1].changed == 0x04 && samples[1].switches == 0xff);
+    CHECK(samples[0].timestamp_ns < samples[1].timestamp_ns);
+    CHECK(pifacecad_sampler_read(&cursor, samples, 8) == 0);
+    CHECK(pifacecad_sampler_switches() == 0xff);
+}
+
+static void test_uinput_leaves_sampler(void)
+{
+    // a sampler someone else started keeps running whether or not the
+    // bridge could be created (no /dev/uinput in most sandboxes)
+    CHECK(pifacecad_sampler_start(1000) == 0);
+    if (pifacecad_uinput_start(NULL, NULL, 1000) >= 0) {
+        errno = 0;
+        CHECK(pifacecad_uinput_start(NULL, NULL, 1000) == -1);
+        CHECK(errno == EBUSY);
+        pifacecad_uinput_stop();
+    } else {
+        CHECK(errno != EBUSY);
+    }
+    errno = 0;
+    CHECK(pifacecad_sampler_start(1000) == -1);
+    CHECK(errno == EBUSY);
+    pifacecad_sampler_stop();
+
+    // and one the bridge started is stopped with it
+    if (pifacecad_uinput_start(NULL, NULL, 1000) >= 0) {
+        pifacecad_uinput_stop();
+    }
+    CHECK(pifacecad_sampler_start(1000) == 0);
+    pifacecad_sampler_stop();
+}
+
+static void test_async_reap_beyond_queue(void)
+{
+    CHECK(pifacecad_async_open() >= 0);
+    uint32_t tokens[PIFACECAD_ASYNC_QUEUE_LEN];
+    int i;
+    for (i = 0; i < PIFACECAD_ASYNC_QUEUE_LEN; i++) {
+        CHECK(pifacecad_lcd_set_cursor_async(i % LCD_WIDTH, 0) != 0);
+    }
+    pifacecad_rt_call(noop, NULL); // the worker runs jobs in order
+
+    // every request has completed but none are reaped: the queue is full
+    errno = 0;
+    CHECK(pifacecad_lcd_clear_async() == 0);
+    CHECK(errno == EAGAIN);
+
+    CHECK(pifacecad_async_reap(tokens, 4) == 4);
+    for (i = 0; i < 4; i++) {
+        CHECK(pifacecad_lcd_set_cursor_async(i, 1) != 0);
+    }
+    pifacecad_rt_call(noop, NULL);
+    CHECK(pifacecad_lcd_clear_async() == 0);
+
+    int reaped = 0, n;
+    while ((n = pifacecad_async_reap(tokens, PIFACECAD_ASYNC_QUEUE_LEN)) > 0) {
+        reaped += n;
+    }
+    CHECK(reaped == PIFACECAD_ASYNC_QUEUE_LEN);
+    CHECK(pifacecad_lcd_clear_async() != 0);
+    pifacecad_async_close();
+}
+
+static void test_async_close_waits(void)
+{
+    // with a worker someone else started, close still waits for the
+    // requests and leaves the worker running
+    CHECK(pifacecad_rt_start(NULL) == 0);
+    CHECK(pifacecad_async_open() >= 0);
+    pifacecad_lcd_clear();
+    int i;
+    for (i = 0; i < PIFACECAD_ASYNC_QUEUE_LEN; i++) {
+        CHECK(pifacecad_lcd_write_async("x") != 0);
+    }
+    pifacecad_async_close();
+
+    // the mirror is read here, not on the worker
+    struct pifacecad_display_snapshot snapshot;
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(snapshot.ddram[PIFACECAD_ASYNC_QUEUE_LEN - 1] == 'x');
+    errno = 0;
+    CHECK(pifacecad_rt_start(NULL) < 0);
+    CHECK(errno == EBUSY);
+    pifacecad_rt_stop();
+
+    // the worker async_open starts is stopped again on close
+    CHECK(pifacecad_async_open() >= 0);
+    CHECK(pifacecad_lcd_write_async("y") != 0);
+    pifacecad_async_close();
+    CHECK(pifacecad_rt_start(NULL) == 0);
+    pifacecad_rt_stop();
+}
+
+static void test_mirror_snapshot(void)
+{
+    struct pifacecad_display_snapshot before, snapshot;
+    CHECK(pifacecad_mirror_read(TEST_MIRROR_NAME, &before) == 0);
+
+    pifacecad_lcd_clear();
+    pifacecad_lcd_write("Mirror\nshot");
+    pifacecad_lcd_blink_off();
+    pifacecad_lcd_backlight_on();
+    const uint8_t bitmap[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    pifacecad_lcd_store_custom_bitmap(7, (uint8_t *) bitmap);
+    pifacecad_lcd_set_cursor(3, 1);
+
+    CHECK(pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot) == 0);
+    CHECK(memcmp(snapshot.ddram, "Mirror ", 7) == 0);
+    CHECK(memcmp(snapshot.ddram + 40, "shot ", 5) == 0);
+    CHECK(memcmp(snapshot.cgram + 7 * 8, bitmap, 8) == 0);
+    CHECK(snapshot.cursor_address == colrow2address(3, 1));
+    CHECK(!(snapshot.display_control & LCD_BLINKON));
+    CHECK(snapshot.display_control & LCD_DISPLAYON);
+    CHECK(snapshot.backlight == 1);
+    CHECK(snapshot.display_shift == 0);
+    CHECK(snapshot.updated_ns > before.updated_ns);
+
+    errno = 0;
+    CHECK(pifacecad_mirror_read("/pifacecad-test-sim-none", &snapshot) < 0);
+    CHECK(errno == ENOENT);
+    pifacecad_lcd_blink_on();
+}
+
+static void test_bargraph_row_1_past_col_16(void)
+{
+    struct pifacecad_display_snapshot snapshot;
+    struct pifacecad_bargraph bar;
+    int i;
+    pifacecad_lcd_clear();
+    pifacecad_lcd_write("Row zero");
+    CHECK(pifacecad_bargraph_init(&bar, 10, 1, 12,
+                                  PIFACECAD_BAR_HORIZONTAL, 0) == 0);
+    pifacecad_bargraph_set(&bar, 1, 1);
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    for (i = 10; i < 22; i++) {
+        CHECK(snapshot.ddram[i + 40] == 0xff);
+    }
+    CHECK(memcmp(snapshot.ddram, "Row zero  ", 10) == 0);
+    CHECK(snapshot.ddram[16] == ' ' && snapshot.ddram[21] == ' ');
+
+    // the bar stops at the end of the row
+    CHECK(pifacecad_bargraph_init(&bar, 30, 1, 20,
+                                  PIFACECAD_BAR_HORIZONTAL, 0) == 0);
+    CHECK(bar.cells == 10);
+    CHECK(pifacecad_bargraph_init(&bar, 45, 1, 4,
+                                  PIFACECAD_BAR_HORIZONTAL, 0) == -1);
+    CHECK(pifacecad_bargraph_init(&bar, 0, 2, 4,
+                                  PIFACECAD_BAR_HORIZONTAL, 0) == -1);
+
+    // glyphs overwritten behind the bar's back are stored again
+    const uint8_t other[8] = {0x1f, 0, 0x1f, 0, 0x1f, 0, 0x1f, 0};
+    pifacecad_lcd_store_custom_bitmap(0, (uint8_t *) other);
+    CHECK(pifacecad_bargraph_init(&bar, 0, 0, 4,
+                                  PIFACECAD_BAR_HORIZONTAL, 0) == 0);
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    for (i = 0; i < 8; i++) {
+        CHECK(snapshot.cgram[i] == 0x10); // one column filled
+    }
+
+    // a max near UINT_MAX doesn't overflow the scaling
+    pifacecad_bargraph_set(&bar, 0xfffffff0u, 0xffffffffu);
+    CHECK(bar.level == pifacecad_bargraph_resolution(&bar));
+    pifacecad_bargraph_set(&bar, 0x7fffffffu, 0xffffffffu);
+    CHECK(bar.level == pifacecad_bargraph_resolution(&bar) / 2);
+}
+
+static void test_sprite_cgram_diff(void)
+{
+    static const uint8_t frames[2][8] = {
+        {0x00, 0x0a, 0x00, 0x11, 0x0e, 0x00, 0x00, 0x00},
+        {0x00, 0x0a, 0x04, 0x11, 0x0e, 0x00, 0x1f, 0x00},
+    };
+    struct pifacecad_display_snapshot snapshot;
+    struct pifacecad_sprite sprite;
+
+    pifacecad_lcd_clear();
+    pifacecad_lcd_write("ab");
+    CHECK(pifacecad_sprite_add(&sprite, 5, frames, 2, 1000) == 0);
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(memcmp(snapshot.cgram + 5 * 8, frames[0], 8) == 0);
+
+    // only rows 2 and 6 differ, sent as two runs
+    sprite.next_ns = 0;
+    pifacecad_sprite_tick();
+    CHECK(sprite.frame == 1);
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(memcmp(snapshot.cgram + 5 * 8, frames[1], 8) == 0);
+
+    // and the next write still lands after the text
+    pifacecad_lcd_write("c");
+    CHECK(strncmp(visible_row(0), "abc ", 4) == 0);
+
+    sprite.next_ns = 0;
+    pifacecad_sprite_tick();
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(memcmp(snapshot.cgram + 5 * 8, frames[0], 8) == 0);
+    pifacecad_sprite_remove(&sprite);
+
+    CHECK(pifacecad_sprite_start() == 0);
+    pifacecad_sprite_stop();
+    CHECK(pifacecad_sprite_start() == 0);
+    pifacecad_sprite_stop();
+}
+
+static void test_lcd_check_unsupported(void)
+{
+    errno = 0;
+    CHECK(pifacecad_lcd_check() == -1);
+    CHECK(errno == ENOTSUP);
+}
+
+static void test_reload_unsupported(void)
+{
+    uint8_t ram[LCD_RAM_WIDTH];
+    pifacecad_lcd_clear();
+    pifacecad_lcd_write("kept");
+
+    // nothing answers on a simulated board, and nothing is lost
+    errno = 0;
+    CHECK(pifacecad_lcd_reload() == -1);
+    CHECK(errno == ENOTSUP);
+    errno = 0;
+    CHECK(pifacecad_lcd_read_ddram(ram) == -1);
+    CHECK(errno == ENOTSUP);
+    CHECK(pifacecad_lcd_read_address() == -1);
+    CHECK(strncmp(visible_row(0), "kept ", 5) == 0);
+    CHECK(pifacecad_lcd_get_cursor_address() == 4);
+}
+
+static void test_latency_switch_to_screen(void)
+{
+    struct pifacecad_latency_stats stats;
+    pifacecad_latency_start();
+    pifacecad_read_switches(); // the state the first edge is seen against
+
+    // nothing changed, so a write isn't an answer to anything
+    pifacecad_lcd_write("-");
+    pifacecad_latency_stats(&stats);
+    CHECK(stats.count == 0);
+
+    pifacecad_sim_set_switch(1, 1);
+    pifacecad_read_switches();
+    sleep_ms(5);
+    pifacecad_lcd_write("+");
+    pifacecad_latency_stats(&stats);
+    CHECK(stats.count == 1);
+    CHECK(stats.min_ns >= 5000000 && stats.min_ns == stats.max_ns);
+    CHECK(stats.p50_ns == stats.min_ns && stats.mean_ns == stats.min_ns);
+    unsigned long below = 0;
+    int i;
+    for (i = 0; i < 12; i++) {
+        below += stats.histogram[i];
+    }
+    CHECK(below == 0); // 5ms is in 4096-8192us or later
+
+    // once answered, more writes don't count again
+    pifacecad_lcd_write("+");
+    pifacecad_latency_stats(&stats);
+    CHECK(stats.count == 1);
+
+    pifacecad_latency_stop();
+    pifacecad_sim_set_switch(1, 0);
+    pifacecad_read_switches();
+    pifacecad_lcd_write("-");
+    pifacecad_latency_stats(&stats);
+    CHECK(stats.count == 1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void test_clear_returns_before_execution(void)
+{
+    // clear doesn't wait for the controller, the next pulse does
+    const uint64_t start = now_ns();
+    pifacecad_lcd_clear();
+    CHECK(now_ns() - start < DELAY_CLEAR_NS);
+    pifacecad_lcd_write("x");
+    CHECK(now_ns() - start >= DELAY_CLEAR_NS);
+    CHECK(strncmp(visible_row(0), "x ", 2) == 0);
+}
+
+static void test_group_refuses_sampler(void)
+{
+    const uint8_t boards[] = {0, 1};
+    uint8_t switches[2];
+
+    CHECK(pifacecad_sampler_start(1000) == 0);
+    errno = 0;
+    CHECK(pifacecad_group_open(boards, 2) == -1);
+    CHECK(errno == EBUSY);
+    pifacecad_sampler_stop();
+
+    CHECK(pifacecad_group_open(boards, 2) >= 0);
+    errno = 0;
+    CHECK(pifacecad_sampler_start(1000) == -1);
+    CHECK(errno == EBUSY);
+    errno = 0;
+    CHECK(pifacecad_uinput_start(NULL, NULL, 1000) == -1);
+    CHECK(errno == EBUSY);
+    CHECK(pifacecad_group_read_all_switches(switches) == 2);
+    pifacecad_group_close();
+
+    errno = 0;
+    CHECK(pifacecad_group_read_all_switches(switches) == -1);
+    CHECK(errno == ENODEV);
+}
+
+static void test_writev_segments(void)
+{
+    pifacecad_lcd_clear();
+    const struct pifacecad_lcd_segment segments[] = {
+        {0, 0, "Temp:xx", 5}, // only len bytes are sent
+        {6, 0, "21.5", 4},
+        {PIFACECAD_LCD_HERE, 0, "C", 1},
+        {2, 1, "a\nb", 3},
+    };
+    CHECK(pifacecad_lcd_writev(segments, 4) == colrow2address(1, 1));
+    CHECK(strcmp(visible_row(0), "Temp: 21.5C     ") == 0);
+    CHECK(strcmp(visible_row(1), "b a             ") == 0);
+
+    // the last address is where the next write carries on
+    pifacecad_lcd_write("!");
+    CHECK(strncmp(visible_row(1), "b!a", 3) == 0);
+}
+
+static void test_every_data_byte(void)
+{
+    struct pifacecad_display_snapshot snapshot;
+    int value = 0;
+    while (value < 256) {
+        pifacecad_lcd_set_cursor_address(0);
+        int i;
+        for (i = 0; i < 40 && value + i < 256; i++) {
+            pifacecad_lcd_send_data(value + i);
+        }
+        pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+        for (i = 0; i < 40 && value + i < 256; i++) {
+            CHECK(snapshot.ddram[i] == value + i);
+        }
+        value += 40;
+    }
+    pifacecad_lcd_clear();
+}
+
+static void test_screen_cursor_past_col_16(void)
+{
+    struct pifacecad_display_snapshot snapshot;
+    pifacecad_screen_clear(0);
+    pifacecad_screen_write(0, 18, 1, "ab", 2); // cursor at (20, 1)
+    CHECK(pifacecad_screen_show(0) == 0);
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(snapshot.cursor_address == colrow2address(20, 1));
+    CHECK(pifacecad_lcd_get_cursor_address() == colrow2address(20, 1));
+    CHECK(memcmp(&snapshot.ddram[40 + 18], "ab", 2) == 0);
+
+    // a new glyph alone still puts the cursor back in DDRAM
+    const uint8_t glyph[8] = {0x15, 0x0a, 0x15, 0x0a, 0x15, 0x0a, 0x15, 0};
+    CHECK(pifacecad_screen_store_custom_bitmap(0, 6, glyph) == 0);
+    pifacecad_lcd_send_data('Z');
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(memcmp(snapshot.cgram + 6 * 8, glyph, 8) == 0);
+    CHECK(snapshot.ddram[40 + 20] == 'Z');
+}
+
+static void test_sched_priorities(void)
+{
+    struct pifacecad_display_snapshot snapshot;
+    const uint8_t bell[8] = {0x04, 0x0e, 0x0e, 0x0e, 0x1f, 0x00, 0x04, 0x00};
+    CHECK(pifacecad_sched_open() == 0);
+    pifacecad_lcd_clear();
+    CHECK(pifacecad_sched_write(0, 0, "low priority text", 17,
+                                PIFACECAD_PRIORITY_LOW) == 0);
+    CHECK(pifacecad_sched_write(0, 1, "FIRE ALARM", 10,
+                                PIFACECAD_PRIORITY_URGENT) == 0);
+    // drops the low priority cells it covers
+    CHECK(pifacecad_sched_write(0, 0, "NEW", 3,
+                                PIFACECAD_PRIORITY_NORMAL) == 0);
+    CHECK(pifacecad_sched_store_custom_bitmap(3, bell,
+                                              PIFACECAD_PRIORITY_HIGH) == 0);
+    pifacecad_sched_wait();
+    CHECK(pifacecad_sched_pending() == 0);
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(memcmp(snapshot.ddram, "NEW priority text ", 18) == 0);
+    CHECK(memcmp(&snapshot.ddram[40], "FIRE ALARM ", 11) == 0);
+    CHECK(memcmp(&snapshot.cgram[3 * 8], bell, 8) == 0);
+    pifacecad_sched_close();
+
+    // the worker async started is shared, and outlives async
+    CHECK(pifacecad_async_open() >= 0);
+    CHECK(pifacecad_sched_open() == 0);
+    pifacecad_async_close();
+    CHECK(pifacecad_sched_write(0, 0, "shared", 6,
+                                PIFACECAD_PRIORITY_NORMAL) == 0);
+    pifacecad_sched_wait();
+    CHECK(strncmp(visible_row(0), "shared", 6) == 0);
+    pifacecad_sched_close();
+    CHECK(pifacecad_rt_start(NULL) == 0); // the last user stopped it
+    pifacecad_rt_stop();
+}
+
+static void test_pager_flip_contents(void)
+{
+    const char * one = "Page one\nfirst";
+    const char * two = "Page two\nsecond";
+    const char * three = "Page three\nthird";
+    CHECK(pifacecad_pager_open() == 0);
+    CHECK(pifacecad_pager_prefetch(one, strlen(one)) == 0);
+    CHECK(pifacecad_pager_flip() == 0);
+    CHECK(strcmp(visible_row(0), "Page one        ") == 0);
+    CHECK(strcmp(visible_row(1), "first           ") == 0);
+
+    // nothing visible changes until the flip
+    CHECK(pifacecad_pager_prefetch(two, strlen(two)) == 0);
+    CHECK(strcmp(visible_row(0), "Page one        ") == 0);
+    CHECK(pifacecad_pager_flip() == 0);
+    CHECK(strcmp(visible_row(0), "Page two        ") == 0);
+    CHECK(strcmp(visible_row(1), "second          ") == 0);
+    errno = 0;
+    CHECK(pifacecad_pager_flip() == -1);
+    CHECK(errno == EAGAIN);
+
+    // through the scheduler the page is sent in the background
+    CHECK(pifacecad_sched_open() == 0);
+    CHECK(pifacecad_pager_prefetch(three, strlen(three)) == 0);
+    pifacecad_sched_wait();
+    CHECK(strcmp(visible_row(1), "second          ") == 0);
+    CHECK(pifacecad_pager_flip() == 0);
+    CHECK(strcmp(visible_row(0), "Page three      ") == 0);
+    CHECK(strcmp(visible_row(1), "third           ") == 0);
+    pifacecad_sched_close();
+
+    pifacecad_pager_close();
+    struct pifacecad_display_snapshot snapshot;
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &snapshot);
+    CHECK(snapshot.display_shift == 0);
+}
+
+static void test_interrupt_capture_kept(void)
+{
+    uint8_t switches;
+    CHECK(pifacecad_enable_interrupts() == 0);
+    pifacecad_read_switches();
+
+    // a press and release between waits is still reported
+    pifacecad_sim_set_switch(2, 1);
+    pifacecad_sim_set_switch(2, 0);
+    CHECK(pifacecad_wait_for_switches(&switches, 0) > 0);
+    CHECK(switches == (0xff & ~(1 << 2)));
+    CHECK(pifacecad_read_switches() == 0xff);
+    CHECK(pifacecad_wait_for_switches(&switches, 10) == 0);
+    pifacecad_disable_interrupts();
+}
+
+/* runs pifacecad watch on a simulated board and checks the edges it
+ * prints, without their timestamps */
+static void test_watch_edges(void)
+{
+    char script[] = "/tmp/pifacecad-test-sim-XXXXXX";
+    const int fd = mkstemp(script);
+    CHECK(fd >= 0);
+    FILE * file = fdopen(fd, "w");
+    fputs("20 0 press\n"
+          "20 0 release\n" // too quick for polling, kept by the capture
+          "40 3 press\n"
+          "60 4 press\n"
+          "80 3 release\n", file);
+    fclose(file);
+
+    char command[128];
+    snprintf(command, sizeof(command), "./pifacecad --sim %s watch 5", script);
+    FILE * watch = popen(command, "r");
+    CHECK(watch != NULL);
+    const char * expected[] = {
+        "0 pressed", "0 released", "3 pressed", "4 pressed", "3 released",
+    };
+    char line[128];
+    int num = 0;
+    while (watch != NULL && fgets(line, sizeof(line), watch) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        const char * edge = strchr(line, ' '); // after the timestamp
+        CHECK(num < 5 && edge != NULL && strcmp(edge + 1, expected[num]) == 0);
+        num++;
+    }
+    CHECK(watch != NULL && pclose(watch) == 0);
+    CHECK(num == 5);
+
+    snprintf(command, sizeof(command),
+             "./pifacecad --sim %s --json watch 1", script);
+    watch = popen(command, "r");
+    CHECK(watch != NULL && fgets(line, sizeof(line), watch) != NULL);
+    CHECK(strstr(line, "\"switch\": 0, \"edge\": \"pressed\"}") != NULL);
+    CHECK(watch != NULL && pclose(watch) == 0);
+    unlink(script);
+}
+
+static void test_pwm_duty_changes(void)
+{
+    struct pifacecad_display_snapshot before, after;
+    unsigned long edges, merged;
+    CHECK(pifacecad_backlight_pwm_start(0, 200, 0) == 0);
+    sleep_ms(20); // fully off, the worker is idling
+    pifacecad_backlight_pwm_stats(&edges, &merged);
+    CHECK(edges + merged == 0);
+
+    // a new duty applies straight away, not after the idle sleep
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &before);
+    CHECK(pifacecad_backlight_pwm_set(128) == 0);
+    sleep_ms(30);
+    pifacecad_backlight_pwm_stats(&edges, &merged);
+    CHECK(edges >= 4);
+
+    // the edges aren't screen updates
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &after);
+    CHECK(after.updated_ns == before.updated_ns);
+
+    CHECK(pifacecad_backlight_pwm_set(255) == 0);
+    sleep_ms(10);
+    pifacecad_backlight_pwm_stats(&edges, &merged);
+    sleep_ms(30);
+    unsigned long edges_later, merged_later;
+    pifacecad_backlight_pwm_stats(&edges_later, &merged_later);
+    CHECK(edges_later == edges && merged_later == merged);
+
+    // stopping fully on leaves the backlight on, and says so
+    pifacecad_backlight_pwm_stop();
+    pifacecad_mirror_read(TEST_MIRROR_NAME, &after);
+    CHECK(after.backlight == 1);
+    CHECK(pifacecad_backlight_pwm_set(0) == -1);
+}
+
+static int pwm_setting = 0;
+
+static void * set_pwm_duty(void * arg)
+{
+    uint8_t duty = 0;
+    while (__atomic_load_n(&pwm_setting, __ATOMIC_ACQUIRE)) {
+        pifacecad_backlight_pwm_set(duty++); // fails while stopped
+    }
+    return NULL;
+}
+
+static void test_pwm_set_while_restarting(void)
+{
+    pthread_t setter;
+    __atomic_store_n(&pwm_setting, 1, __ATOMIC_RELEASE);
+    pthread_create(&setter, NULL, set_pwm_duty, NULL);
+    int i;
+    for (i = 0; i < 20; i++) {
+        CHECK(pifacecad_backlight_pwm_start(128, 200, 0) == 0);
+        sleep_ms(1);
+        pifacecad_backlight_pwm_stop();
+    }
+    __atomic_store_n(&pwm_setting, 0, __ATOMIC_RELEASE);
+    pthread_join(setter, NULL);
+    CHECK(pifacecad_backlight_pwm_set(0) == -1);
+}
+
+int main(void)
+{
+    if (pifacecad_sim_open("/dev/null") < 0 || pifacecad_open() < 0) {
+        perror("pifacecad_open");
+        return 1;
+    }
+    pifacecad_mirror_open(TEST_MIRROR_NAME);
+
+    test_shared_state_seeded();
+    test_uinput_leaves_sampler();
+    test_rt_worker();
+    test_sampler_ring();
+    test_async_reap_beyond_queue();
+    test_async_close_waits();
+    test_mirror_snapshot();
+    test_bargraph_row_1_past_col_16();
+    test_sprite_cgram_diff();
+    test_lcd_check_unsupported();
+    test_reload_unsupported();
+    test_clear_returns_before_execution();
+    test_latency_switch_to_screen();
+    test_group_refuses_sampler();
+    test_writev_segments();
+    test_every_data_byte();
+    test_screen_cursor_past_col_16();
+    test_sched_priorities();
+    test_pager_flip_contents();
+    test_interrupt_capture_kept();
+    test_watch_edges();
+    test_pwm_duty_changes();
+    test_pwm_set_while_restarting();
+
+    pifacecad_mirror_close();
+    pifacecad_close();
+    pifacecad_sim_close();
+    printf("%s (%d failed)\n", failures ? "FAIL" : "OK", failures);
+    return failures != 0;
+}
@@ -14,10 +14,38 @@
  *
  * Or shorthand:
  * pifacedigital -b 1 read switch
+ *
+ * Share the LCD state with other processes using the library:
+ * pifacedigital --shared write "Hello, World"
+ *
+ * Show what is on the screen (from the display mirror, no SPI):
+ * pifacedigital screenshot
+ *
+ * Measure switch to screen latency over 100 presses, on a simulated board:
+ * pifacedigital --sim presses.txt latency 100
+ *
+ * Show a stream of text (with a few VT100 escapes) at up to 20 frames/s:
+ * tail -f /var/log/syslog | pifacedigital --interval 50 console
+ *
+ * Publish the switches as a keyboard until interrupted:
+ * pifacedigital --keymap playpause,stopcd,previoussong,nextsong uinput
+ *
+ * Run a file of commands (one per line, "-" for stdin) in one session:
+ * pifacedigital --batch screen.txt
+ *
+ * Print a line (or JSON object) per switch press and release:
+ * pifacedigital --json watch
  */
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <argp.h>
 #include <strings.h>
+#include <linux/input.h>
 #include <mcp23s17.h>
 #include <pifacecad.h>
 
@@ -39,7 +67,18 @@ static char doc[] = "Command line tool for PiFace Control and Display.\n\n"
 "    backlight on             Backlight 'on' or 'off'.\n"
 "    home                     Set the cursor to the home position.\n"
 "    clear                    Clear the screen.\n"
-"    cursor                   Sets the cursor to the COL and ROW specified.\n\n"
+"    cursor                   Sets the cursor to the COL and ROW specified.\n"
+"    screenshot               Prints the screen from the display mirror.\n"
+"    latency                  Measures switch to screen latency (opt arg:\n"
+"                             number of presses).\n"
+"    console                  Shows stdin on the LCD like a terminal.\n"
+"    uinput                   Publishes the switches as a keyboard until\n"
+"                             interrupted (see --keymap).\n"
+"    watch                    Prints each switch press and release until\n"
+"                             interrupted (opt arg: number of events).\n\n"
+"Batch files hold one open, read, write, backlight, home, clear,\n"
+"setcursor or sleep (milliseconds) command per line. Quote arguments\n"
+"with spaces, '\\n' is a new line and '#' starts a comment.\n\n"
 "Example:\n\n"
 "    $ pifacecad open blinkoff\n"
 "    $ pifacecad write \"Hello, world!\"\n"
@@ -47,11 +86,23 @@ static char doc[] = "Command line tool for PiFace Control and Display.\n\n"
 "    $ pifacecad setcursor 7 1\n";
 
 /* A description of the arguments we accept. */
-static char args_doc[] = "CMD CMDARG0 CMDARG1 CMDARG2";
+static char args_doc[] = "CMD CMDARG0 CMDARG1 CMDARG2\n--batch FILE";
 
 /* The options we understand. */
 static struct argp_option options[] = {
     {"bit-num", 'b', "BITNUM", 0, "Bit number to read/write to." },
+    {"shared", 's', 0, 0, "Share LCD state with other processes." },
+    {"mirror", 'm', 0, 0, "Publish the display mirror (for screenshot)." },
+    {"sim", 'S', "SCRIPT", 0, "Use a simulated board driven by SCRIPT." },
+    {"interval", 'i', "MS", 0,
+     "Switch polling (latency, uinput, longest for watch) or screen "
+     "update (console) interval." },
+    {"batch", 'B', "FILE", 0,
+     "Run the commands in FILE ('-' for stdin) in one session." },
+    {"keymap", 'k', "KEYS", 0,
+     "Comma separated keys for switches 0-7 (uinput): names (enter, left, "
+     "f1, volumeup...) or key codes, 0 for none." },
+    {"json", 'j', 0, 0, "One JSON object per line (watch)." },
     { 0 },
 };
 
@@ -61,6 +112,13 @@ struct arguments
     char * cmd;
     char * cmdargs[3];
     int bit_num;
+    int shared;
+    int mirror;
+    char * sim;
+    int interval_ms;
+    char * keymap;
+    char * batch;
+    int json;
 };
 
 /* Parse a single option. */
@@ -76,6 +134,37 @@ static error_t parse_opt(int key, char * arg, struct argp_state * state)
         arguments->bit_num = atoi(arg);
         break;
 
+    case 's':
+        arguments->shared = 1;
+        break;
+
+    case 'm':
+        arguments->mirror = 1;
+        break;
+
+    case 'S':
+        arguments->sim = arg;
+        break;
+
+    case 'i':
+        arguments->interval_ms = atoi(arg);
+        if (arguments->interval_ms < 0) {
+            argp_error(state, "interval must not be negative.");
+        }
+        break;
+
+    case 'k':
+        arguments->keymap = arg;
+        break;
+
+    case 'B':
+        arguments->batch = arg;
+        break;
+
+    case 'j':
+        arguments->json = 1;
+        break;
+
     case ARGP_KEY_ARG:
         if (state->arg_num >= 4) {
             argp_usage(state); /* Too many arguments. */
@@ -91,9 +180,12 @@ static error_t parse_opt(int key, char * arg, struct argp_state * state)
         break;
 
     case ARGP_KEY_END:
-        if (state->arg_num < 1)
+        if (state->arg_num < 1 && arguments->batch == NULL)
              /* Not enough arguments. */
              argp_usage (state);
+        if (state->arg_num > 0 && arguments->batch != NULL) {
+            argp_error(state, "give either a command or --batch, not both.");
+        }
         break;
 
     default:
@@ -108,6 +200,13 @@ static struct argp argp = {options, parse_opt, args_doc, doc};
 
 uint8_t str2reg(char * reg_str);
 void pfc_read_switch(int bit_num, uint8_t reg);
+const char * pfc_run(char * cmd, char * cmdargs[3], int bit_num);
+int pfc_batch(const char * path, int bit_num);
+int pfc_screenshot(void);
+void pfc_latency(unsigned long count, int interval_ms, int sim);
+void pfc_console(int interval_ms);
+int pfc_uinput(const char * keymap_str, int interval_ms, int sim);
+void pfc_watch(unsigned long count, int json, int interval_ms, int sim);
 
 
 int main(int argc, char **argv)
@@ -120,6 +219,13 @@ int main(int argc, char **argv)
     arguments.cmdargs[1] = NULL;
     arguments.cmdargs[2] = NULL;
     arguments.bit_num = -1;
+    arguments.shared = 0;
+    arguments.mirror = 0;
+    arguments.sim = NULL;
+    arguments.interval_ms = -1; // command's default
+    arguments.keymap = NULL;
+    arguments.batch = NULL;
+    arguments.json = 0;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
@@ -136,54 +242,252 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+
+    // doesn't need the board at all
+    if (arguments.cmd != NULL && strcmp(arguments.cmd, "screenshot") == 0) {
+        exit(pfc_screenshot());
+    }
+
+    if (arguments.shared && pifacecad_shared_state_open(NULL) < 0) {
+        fprintf(stderr, "pifacecad: could not open shared LCD state.\n");
+        exit(1);
+    }
+
+    if (arguments.sim != NULL && pifacecad_sim_open(arguments.sim) < 0) {
+        fprintf(stderr, "pifacecad: could not load simulation script.\n");
+        exit(1);
+    }
+
     pifacecad_open_noinit();
 
-    if (strcmp(arguments.cmd, "open") == 0) {
+    if (arguments.mirror && pifacecad_mirror_open(NULL) < 0) {
+        fprintf(stderr, "pifacecad: could not open display mirror.\n");
+        exit(1);
+    }
+
+    int ret = 0;
+    if (arguments.batch != NULL) {
+        ret = pfc_batch(arguments.batch, arguments.bit_num);
+
+    } else if (strcmp(arguments.cmd, "latency") == 0) {
+        const unsigned long count = arguments.cmdargs[0] == NULL ? \
+            0 : strtoul(arguments.cmdargs[0], NULL, 10);
+        pfc_latency(count,
+                    arguments.interval_ms < 0 ? 10 : arguments.interval_ms,
+                    arguments.sim != NULL);
+
+    } else if (strcmp(arguments.cmd, "console") == 0) {
+        pfc_console(arguments.interval_ms < 0 ? 50 : arguments.interval_ms);
+
+    } else if (strcmp(arguments.cmd, "uinput") == 0) {
+        ret = pfc_uinput(arguments.keymap,
+                         arguments.interval_ms < 0 ? \
+                             5 : arguments.interval_ms,
+                         arguments.sim != NULL);
+
+    } else if (strcmp(arguments.cmd, "watch") == 0) {
+        const unsigned long count = arguments.cmdargs[0] == NULL ? \
+            0 : strtoul(arguments.cmdargs[0], NULL, 10);
+        pfc_watch(count,
+                  arguments.json,
+                  arguments.interval_ms < 0 ? 8 : arguments.interval_ms,
+                  arguments.sim != NULL);
+
+    } else {
+        const char * error = pfc_run(arguments.cmd,
+                                     arguments.cmdargs,
+                                     arguments.bit_num);
+        if (error != NULL) {
+            fprintf(stderr, "pifacecad: %s\n", error);
+            ret = 1;
+        }
+    }
+
+    pifacecad_close();
+    pifacecad_mirror_close();
+    pifacecad_shared_state_close();
+    pifacecad_sim_close();
+
+    exit(ret);
+}
+
+/* runs one of the short commands, returns NULL or what went wrong */
+const char * pfc_run(char * cmd, char * cmdargs[3], int bit_num)
+{
+    if (strcmp(cmd, "open") == 0) {
         pifacecad_open();
         int i;
         for (i = 0; i <= 2; i++) {
-            if (arguments.cmdargs[i] == NULL) {
+            if (cmdargs[i] == NULL) {
                 continue;
             }
-            if (strcmp(arguments.cmdargs[i], "displayoff") == 0) {
+            if (strcmp(cmdargs[i], "displayoff") == 0) {
                 pifacecad_lcd_display_off();
-            }
-            if (strcmp(arguments.cmdargs[i], "blinkoff") == 0) {
+            } else if (strcmp(cmdargs[i], "blinkoff") == 0) {
                 pifacecad_lcd_blink_off();
-            }
-            if (strcmp(arguments.cmdargs[i], "cursoroff") == 0) {
+            } else if (strcmp(cmdargs[i], "cursoroff") == 0) {
                 pifacecad_lcd_cursor_off();
+            } else {
+                return "open takes displayoff, cursoroff or blinkoff";
             }
         }
 
-    } else if (strcmp(arguments.cmd, "read") == 0) {
-        pfc_read_switch(arguments.bit_num, str2reg(arguments.cmdargs[0]));
+    } else if (strcmp(cmd, "read") == 0) {
+        if (cmdargs[0] == NULL) {
+            return "read needs a register (switch, switches)";
+        }
+        const uint8_t reg = str2reg(cmdargs[0]);
+        if (reg == 0) {
+            return "no such register";
+        }
+        if (cmdargs[1] != NULL) {
+            bit_num = atoi(cmdargs[1]);
+        }
+        if (bit_num > 7) {
+            return "bit num must in range 0-7";
+        }
+        pfc_read_switch(bit_num, reg);
 
-    } else if (strcmp(arguments.cmd, "write") == 0) {
-        pifacecad_lcd_write(arguments.cmdargs[0]);
+    } else if (strcmp(cmd, "write") == 0) {
+        if (cmdargs[0] == NULL) {
+            return "write needs a message";
+        }
+        pifacecad_lcd_write(cmdargs[0]);
 
-    } else if (strcmp(arguments.cmd, "backlight") == 0) {
-        if (strcmp(arguments.cmdargs[0], "on") == 0) {
+    } else if (strcmp(cmd, "backlight") == 0) {
+        if (cmdargs[0] != NULL && strcmp(cmdargs[0], "on") == 0) {
             pifacecad_lcd_backlight_on();
-        } else {
+        } else if (cmdargs[0] != NULL && strcmp(cmdargs[0], "off") == 0) {
             pifacecad_lcd_backlight_off();
+        } else {
+            return "backlight must be 'on' or 'off'";
         }
 
-    } else if (strcmp(arguments.cmd, "home") == 0) {
+    } else if (strcmp(cmd, "home") == 0) {
         pifacecad_lcd_home();
 
-    } else if (strcmp(arguments.cmd, "clear") == 0) {
+    } else if (strcmp(cmd, "clear") == 0) {
         pifacecad_lcd_clear();
 
-    } else if (strcmp(arguments.cmd, "setcursor") == 0) {
-        const uint8_t col = atoi(arguments.cmdargs[0]);
-        const uint8_t row = atoi(arguments.cmdargs[1]);
+    } else if (strcmp(cmd, "setcursor") == 0) {
+        if (cmdargs[0] == NULL || cmdargs[1] == NULL) {
+            return "setcursor needs a column and a row";
+        }
+        const uint8_t col = atoi(cmdargs[0]);
+        const uint8_t row = atoi(cmdargs[1]);
         pifacecad_lcd_set_cursor(col, row);
+
+    } else {
+        return "no such command";
     }
+    return NULL;
+}
 
-    pifacecad_close();
+/* splits a batch line into at most max words, in place. Words can be
+ * quoted with ' or " and \n, \t, \\ and \" are escapes. Returns the
+ * number of words or -1 on error. */
+static int batch_split(char * line, char * words[], int max)
+{
+    int num = 0;
+    char * in = line;
+    char * out = line;
+    while (1) {
+        while (*in == ' ' || *in == '\t') {
+            in++;
+        }
+        if (*in == '\0' || *in == '#') {
+            return num;
+        }
+        if (num == max) {
+            return -1;
+        }
+        words[num++] = out;
+        char quote = 0;
+        while (*in != '\0' && (quote || (*in != ' ' && *in != '\t'))) {
+            if (quote && *in == quote) {
+                quote = 0;
+                in++;
+            } else if (!quote && (*in == '"' || *in == '\'')) {
+                quote = *in++;
+            } else if (*in == '\\' && quote != '\'' && in[1] != '\0') {
+                in++;
+                *out++ = *in == 'n' ? '\n' : *in == 't' ? '\t' : *in;
+                in++;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        if (quote) {
+            return -1;
+        }
+        if (*in != '\0') {
+            in++;
+        }
+        *out++ = '\0';
+    }
+}
+
+/* runs a file of commands without reopening the board between them,
+ * returns 0 if they all worked */
+int pfc_batch(const char * path, int bit_num)
+{
+    FILE * file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (file == NULL) {
+        perror("pifacecad: could not open batch file");
+        return 1;
+    }
 
-    exit(0);
+    char line[1024];
+    unsigned long line_num = 0;
+    int failed = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_num++;
+        int too_long = 0;
+        if (strchr(line, '\n') == NULL) {
+            // a full buffer without a newline: skip the rest of the line
+            int c = fgetc(file);
+            while (c != EOF && c != '\n') {
+                too_long = 1;
+                c = fgetc(file);
+            }
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char * words[4] = {NULL, NULL, NULL, NULL};
+        const int num = too_long ? 0 : batch_split(line, words, 4);
+        const char * error = NULL;
+        if (too_long) {
+            error = "line too long";
+        } else if (num < 0) {
+            error = "too many arguments or unmatched quote";
+        } else if (num == 0) {
+            continue;
+        } else if (strcmp(words[0], "sleep") == 0) {
+            char * end = NULL;
+            errno = 0;
+            const long ms = words[1] != NULL ? strtol(words[1], &end, 10) : -1;
+            if (ms < 0 || errno != 0 || end == words[1] || *end != '\0') {
+                error = "sleep needs a number of milliseconds";
+            } else {
+                const struct timespec time = {
+                    ms / 1000, (ms % 1000) * 1000000L
+                };
+                nanosleep(&time, NULL);
+            }
+        } else {
+            error = pfc_run(words[0], &words[1], bit_num);
+        }
+        if (error != NULL) {
+            fprintf(stderr, "pifacecad: %s:%lu: %s\n",
+                    file == stdin ? "<stdin>" : path, line_num, error);
+            failed = 1;
+        }
+    }
+
+    if (file != stdin) {
+        fclose(file);
+    }
+    return failed;
 }
 
 uint8_t str2reg(char * reg_str)
@@ -201,8 +505,7 @@ uint8_t str2reg(char * reg_str)
             strcmp(reg_str, "gpioa") == 0) {
         return GPIOA;
     } else {
-        fprintf(stderr, "pifacecad: no such register '%s'\n", reg_str);
-        exit(1);
+        return 0; // no such register
     }
 }
 
@@ -216,3 +519,635 @@ void pfc_read_switch(int bit_num, uint8_t reg)
     }
     printf("%d\n", value);
 }
+
+int pfc_screenshot(void)
+{
+    struct pifacecad_display_snapshot snapshot;
+    if (pifacecad_mirror_read(NULL, &snapshot) < 0) {
+        fprintf(stderr,
+                "pifacecad: no display mirror (is anything using "
+                "pifacecad_mirror_open?)\n");
+        return 1;
+    }
+
+    const int row_width = LCD_RAM_WIDTH / LCD_MAX_LINES;
+    int col, row;
+    printf("+");
+    for (col = 0; col < LCD_WIDTH; col++) {
+        printf("-");
+    }
+    printf("+\n");
+    for (row = 0; row < LCD_MAX_LINES; row++) {
+        printf("|");
+        for (col = 0; col < LCD_WIDTH; col++) {
+            // the visible window moves along DDRAM with the display shift
+            const int ram_col = (col + snapshot.display_shift) % row_width;
+            const uint8_t c = snapshot.ddram[row * row_width + ram_col];
+            if (!(snapshot.display_control & LCD_DISPLAYON)) {
+                printf(" ");
+            } else if (c < 8) {
+                printf("#"); // custom bitmap
+            } else if (c < ' ' || c > '~') {
+                printf("?");
+            } else {
+                printf("%c", c);
+            }
+        }
+        printf("|\n");
+    }
+    printf("+");
+    for (col = 0; col < LCD_WIDTH; col++) {
+        printf("-");
+    }
+    printf("+\n");
+
+    const uint8_t cursor_row = address2row(snapshot.cursor_address);
+    printf("display %s, backlight %s, cursor %s%s at (%d, %d)\n",
+           snapshot.display_control & LCD_DISPLAYON ? "on" : "off",
+           snapshot.backlight ? "on" : "off",
+           snapshot.display_control & LCD_CURSORON ? "on" : "off",
+           snapshot.display_control & LCD_BLINKON ? " (blinking)" : "",
+           snapshot.cursor_address - ROW_OFFSETS[cursor_row],
+           cursor_row);
+    return 0;
+}
+
+/* polls the switches and shows each change on the LCD until count
+ * measurements (0 for no limit) or the end of the simulation script */
+void pfc_latency(unsigned long count, int interval_ms, int sim)
+{
+    const struct timespec interval = {
+        interval_ms / 1000, (interval_ms % 1000) * 1000000L
+    };
+    const int grace = 1000 / (interval_ms > 0 ? interval_ms : 1); // ~1s
+    int left = grace;
+    char msg[LCD_WIDTH + 1];
+    struct pifacecad_latency_stats stats;
+
+    pifacecad_open();
+    pifacecad_lcd_clear();
+    uint8_t last = pifacecad_read_switches();
+    pifacecad_latency_start();
+
+    while (1) {
+        nanosleep(&interval, NULL);
+        const uint8_t switches = pifacecad_read_switches();
+        const uint8_t changed = switches ^ last;
+        last = switches;
+        if (changed) {
+            const int num = __builtin_ctz(changed);
+            snprintf(msg, sizeof(msg), "switch %d %-4s",
+                     num, (switches >> num) & 1 ? "up" : "down");
+            pifacecad_lcd_set_cursor(0, 0);
+            pifacecad_lcd_write(msg);
+        }
+
+        pifacecad_latency_stats(&stats);
+        if (count > 0 && stats.count >= count) {
+            break;
+        }
+        // let the last simulated edge reach the screen
+        if (sim && pifacecad_sim_done() && --left <= 0) {
+            break;
+        }
+    }
+    pifacecad_latency_stop();
+    pifacecad_latency_stats(&stats);
+
+    printf("%lu measurements\n", stats.count);
+    if (stats.count == 0) {
+        return;
+    }
+    printf("min %llu us, mean %llu us, max %llu us\n",
+           (unsigned long long) stats.min_ns / 1000,
+           (unsigned long long) stats.mean_ns / 1000,
+           (unsigned long long) stats.max_ns / 1000);
+    printf("p50 %llu us, p90 %llu us, p99 %llu us\n",
+           (unsigned long long) stats.p50_ns / 1000,
+           (unsigned long long) stats.p90_ns / 1000,
+           (unsigned long long) stats.p99_ns / 1000);
+
+    unsigned long most = 0;
+    int i, first = -1, end = 0;
+    for (i = 0; i < PIFACECAD_LATENCY_BUCKETS; i++) {
+        if (stats.histogram[i] > 0) {
+            if (first < 0) {
+                first = i;
+            }
+            end = i + 1;
+            if (stats.histogram[i] > most) {
+                most = stats.histogram[i];
+            }
+        }
+    }
+    for (i = first; i < end; i++) {
+        printf("%8lu us |", 1UL << i);
+        const int bar = stats.histogram[i] * 50 / most;
+        int j;
+        for (j = 0; j < bar; j++) {
+            printf("#");
+        }
+        printf(" %lu\n", stats.histogram[i]);
+    }
+}
+
+/**********************************************************************/
+/* console: a 16x2 terminal. Input updates a framebuffer straight away,
+ * the LCD is only brought up to date with it (changed cells only) once
+ * every interval, however fast the input arrives.
+ */
+#define CONSOLE_MAX_PARAM 999 // far off the screen, and can't overflow
+
+enum console_state {CONSOLE_TEXT, CONSOLE_ESC, CONSOLE_CSI};
+
+struct console {
+    char fb[LCD_MAX_LINES][LCD_WIDTH]; // what should be on the screen
+    char shown[LCD_MAX_LINES][LCD_WIDTH]; // what is on the screen
+    int col, row;
+    int wrap_pending; // wrote the last column, wrap on the next character
+    enum console_state state;
+    int params[2], num_params;
+};
+
+static uint64_t console_now_ms(void);
+static void console_input(struct console * con, char c);
+static void console_csi(struct console * con, char final);
+static void console_put(struct console * con, char c);
+static void console_newline(struct console * con);
+static void console_scroll(struct console * con, int up);
+static void console_erase(struct console * con, int row, int from, int to);
+static int console_flush(struct console * con);
+
+void pfc_console(int interval_ms)
+{
+    struct console con;
+    memset(&con, 0, sizeof(con));
+    memset(con.fb, ' ', sizeof(con.fb));
+    memset(con.shown, ' ', sizeof(con.shown));
+
+    pifacecad_open();
+    pifacecad_lcd_cursor_off();
+    pifacecad_lcd_blink_off();
+    pifacecad_lcd_clear();
+
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    uint64_t next_flush = 0;
+    int dirty = 0, eof = 0;
+    char buf[256];
+    while (!eof) {
+        // sleep until there is input, or until the next frame is due
+        int timeout = -1;
+        if (dirty) {
+            const uint64_t now = console_now_ms();
+            timeout = next_flush > now ? next_flush - now : 0;
+        }
+        if (poll(&pfd, 1, timeout) > 0) {
+            const ssize_t len = read(STDIN_FILENO, buf, sizeof(buf));
+            if (len <= 0) {
+                eof = 1;
+            }
+            ssize_t i;
+            for (i = 0; i < len; i++) {
+                console_input(&con, buf[i]);
+            }
+            dirty = 1;
+        }
+        if (dirty && console_now_ms() >= next_flush) {
+            console_flush(&con);
+            dirty = 0;
+            next_flush = console_now_ms() + interval_ms;
+        }
+    }
+    console_flush(&con);
+}
+
+static uint64_t console_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+static void console_input(struct console * con, char c)
+{
+    switch (con->state) {
+    case CONSOLE_ESC:
+        con->state = CONSOLE_TEXT;
+        if (c == '[') {
+            con->state = CONSOLE_CSI;
+            con->params[0] = con->params[1] = 0;
+            con->num_params = 0;
+        } else if (c == 'c') { // reset
+            console_erase(con, 0, 0, LCD_WIDTH);
+            console_erase(con, 1, 0, LCD_WIDTH);
+            con->col = con->row = con->wrap_pending = 0;
+        } else if (c == 'D') { // index
+            console_newline(con);
+        } else if (c == 'M') { // reverse index
+            if (con->row == 0) {
+                console_scroll(con, 0);
+            } else {
+                con->row--;
+            }
+        }
+        return;
+
+    case CONSOLE_CSI:
+        if (c >= '0' && c <= '9') {
+            if (con->num_params == 0) {
+                con->num_params = 1;
+            }
+            int * param = &con->params[con->num_params - 1];
+            *param = *param * 10 + (c - '0');
+            if (*param > CONSOLE_MAX_PARAM) {
+                *param = CONSOLE_MAX_PARAM;
+            }
+        } else if (c == ';') {
+            if (con->num_params == 0) {
+                con->num_params = 1;
+            }
+            if (con->num_params < 2) {
+                con->num_params++;
+            }
+        } else if (c >= 0x40 && c <= 0x7e) {
+            console_csi(con, c);
+            con->state = CONSOLE_TEXT;
+        } else if (c == '\x1b') {
+            con->state = CONSOLE_ESC; // broken sequence, start again
+        }
+        return;
+
+    case CONSOLE_TEXT:
+        break;
+    }
+
+    if (c == '\x1b') {
+        con->state = CONSOLE_ESC;
+    } else if (c == '\n') {
+        console_newline(con);
+    } else if (c == '\r') {
+        con->col = 0;
+        con->wrap_pending = 0;
+    } else if (c == '\b') {
+        if (con->col > 0) {
+            con->col--;
+        }
+        con->wrap_pending = 0;
+    } else if (c == '\t') {
+        do {
+            console_put(con, ' ');
+        } while (con->col % 4 != 0 && !con->wrap_pending);
+    } else if ((unsigned char) c >= 0x80 && (unsigned char) c < 0xc0) {
+        // UTF-8 continuation byte, the lead byte was shown as '?'
+    } else if ((unsigned char) c >= 0xc0) {
+        console_put(con, '?');
+    } else if (c >= ' ' && c != 0x7f) {
+        console_put(con, c);
+    }
+}
+
+/* the CSI sequences a 16x2 display can sensibly follow */
+static void console_csi(struct console * con, char final)
+{
+    const int n = con->params[0] > 0 ? con->params[0] : 1;
+    int i;
+    con->wrap_pending = 0;
+    switch (final) {
+    case 'H': // cursor position (row;col, from 1)
+    case 'f':
+        con->row = con->params[0] > 0 ? con->params[0] - 1 : 0;
+        con->col = con->params[1] > 0 ? con->params[1] - 1 : 0;
+        break;
+    case 'A':
+        con->row -= n;
+        break;
+    case 'B':
+        con->row += n;
+        break;
+    case 'C':
+        con->col += n;
+        break;
+    case 'D':
+        con->col -= n;
+        break;
+    case 'J': // erase in display: 0 to end, 1 from start, 2 all
+        if (con->params[0] == 0) {
+            console_erase(con, con->row, con->col, LCD_WIDTH);
+            for (i = con->row + 1; i < LCD_MAX_LINES; i++) {
+                console_erase(con, i, 0, LCD_WIDTH);
+            }
+        } else if (con->params[0] == 1) {
+            for (i = 0; i < con->row; i++) {
+                console_erase(con, i, 0, LCD_WIDTH);
+            }
+            console_erase(con, con->row, 0, con->col + 1);
+        } else {
+            for (i = 0; i < LCD_MAX_LINES; i++) {
+                console_erase(con, i, 0, LCD_WIDTH);
+            }
+        }
+        break;
+    case 'K': // erase in line: 0 to end, 1 from start, 2 all
+        if (con->params[0] == 0) {
+            console_erase(con, con->row, con->col, LCD_WIDTH);
+        } else if (con->params[0] == 1) {
+            console_erase(con, con->row, 0, con->col + 1);
+        } else {
+            console_erase(con, con->row, 0, LCD_WIDTH);
+        }
+        break;
+    case 'S': // scroll up
+        for (i = 0; i < n && i < LCD_MAX_LINES; i++) {
+            console_scroll(con, 1);
+        }
+        break;
+    case 'T': // scroll down
+        for (i = 0; i < n && i < LCD_MAX_LINES; i++) {
+            console_scroll(con, 0);
+        }
+        break;
+    default: // colours and the rest mean nothing here
+        break;
+    }
+    con->row = con->row < 0 ? 0 : con->row;
+    con->row = con->row >= LCD_MAX_LINES ? LCD_MAX_LINES - 1 : con->row;
+    con->col = con->col < 0 ? 0 : con->col;
+    con->col = con->col >= LCD_WIDTH ? LCD_WIDTH - 1 : con->col;
+}
+
+static void console_put(struct console * con, char c)
+{
+    if (con->wrap_pending) {
+        console_newline(con);
+    }
+    con->fb[con->row][con->col] = c;
+    if (con->col == LCD_WIDTH - 1) {
+        con->wrap_pending = 1;
+    } else {
+        con->col++;
+    }
+}
+
+/* '\n' goes to the start of the next line, like a tty with onlcr */
+static void console_newline(struct console * con)
+{
+    con->col = 0;
+    con->wrap_pending = 0;
+    if (con->row == LCD_MAX_LINES - 1) {
+        console_scroll(con, 1);
+    } else {
+        con->row++;
+    }
+}
+
+static void console_scroll(struct console * con, int up)
+{
+    if (up) {
+        memmove(con->fb[0], con->fb[1], (LCD_MAX_LINES - 1) * LCD_WIDTH);
+        console_erase(con, LCD_MAX_LINES - 1, 0, LCD_WIDTH);
+    } else {
+        memmove(con->fb[1], con->fb[0], (LCD_MAX_LINES - 1) * LCD_WIDTH);
+        console_erase(con, 0, 0, LCD_WIDTH);
+    }
+}
+
+static void console_erase(struct console * con, int row, int from, int to)
+{
+    if (to > from) {
+        memset(&con->fb[row][from], ' ', to - from);
+    }
+}
+
+/* writes each changed run of cells as one pifacecad_lcd_writev, returns
+ * the number of cells written */
+static int console_flush(struct console * con)
+{
+    // runs are at least one unchanged cell apart
+    struct pifacecad_lcd_segment runs[LCD_MAX_LINES * (LCD_WIDTH + 1) / 2];
+    int num_runs = 0;
+    int written = 0;
+    int row;
+    for (row = 0; row < LCD_MAX_LINES; row++) {
+        int col = 0;
+        while (col < LCD_WIDTH) {
+            if (con->fb[row][col] == con->shown[row][col]) {
+                col++;
+                continue;
+            }
+            // a single unchanged cell costs less to rewrite than a
+            // set cursor command, so carry on through it
+            int end = col + 1;
+            while (end < LCD_WIDTH && \
+                    (con->fb[row][end] != con->shown[row][end] || \
+                     (end + 1 < LCD_WIDTH && \
+                      con->fb[row][end + 1] != con->shown[row][end + 1]))) {
+                end++;
+            }
+            runs[num_runs].col = col;
+            runs[num_runs].row = row;
+            runs[num_runs].buf = &con->fb[row][col];
+            runs[num_runs].len = end - col;
+            num_runs++;
+            memcpy(&con->shown[row][col], &con->fb[row][col], end - col);
+            written += end - col;
+            col = end;
+        }
+    }
+    if (num_runs > 0) {
+        pifacecad_lcd_writev(runs, num_runs);
+    }
+    return written;
+}
+
+/**********************************************************************/
+/* uinput: runs the switch to key bridge until SIGINT/SIGTERM (or the end
+ * of the simulation script)
+ */
+struct key_name {
+    const char * name;
+    uint16_t code;
+};
+
+static const struct key_name key_names[] = {
+    {"esc", KEY_ESC}, {"enter", KEY_ENTER}, {"space", KEY_SPACE},
+    {"tab", KEY_TAB}, {"backspace", KEY_BACKSPACE},
+    {"up", KEY_UP}, {"down", KEY_DOWN}, {"left", KEY_LEFT},
+    {"right", KEY_RIGHT}, {"home", KEY_HOME}, {"end", KEY_END},
+    {"pageup", KEY_PAGEUP}, {"pagedown", KEY_PAGEDOWN},
+    {"1", KEY_1}, {"2", KEY_2}, {"3", KEY_3}, {"4", KEY_4}, {"5", KEY_5},
+    {"6", KEY_6}, {"7", KEY_7}, {"8", KEY_8}, {"9", KEY_9}, {"0", KEY_0},
+    {"f1", KEY_F1}, {"f2", KEY_F2}, {"f3", KEY_F3}, {"f4", KEY_F4},
+    {"f5", KEY_F5}, {"f6", KEY_F6}, {"f7", KEY_F7}, {"f8", KEY_F8},
+    {"f9", KEY_F9}, {"f10", KEY_F10}, {"f11", KEY_F11}, {"f12", KEY_F12},
+    {"mute", KEY_MUTE}, {"volumedown", KEY_VOLUMEDOWN},
+    {"volumeup", KEY_VOLUMEUP}, {"playpause", KEY_PLAYPAUSE},
+    {"stopcd", KEY_STOPCD}, {"nextsong", KEY_NEXTSONG},
+    {"previoussong", KEY_PREVIOUSSONG}, {"menu", KEY_MENU},
+    {"back", KEY_BACK}, {"select", KEY_SELECT}, {"power", KEY_POWER},
+    {NULL, 0},
+};
+
+// set by SIGINT and SIGTERM in the commands which run until interrupted
+static volatile sig_atomic_t quit_requested = 0;
+
+static void quit_signal(int signum)
+{
+    (void) signum;
+    quit_requested = 1;
+}
+
+static void catch_quit(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = quit_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+/* names are matched without case or a "key_" prefix, anything else must
+ * be a key code */
+static int parse_key(const char * str, uint16_t * code)
+{
+    if (strncasecmp(str, "key_", 4) == 0) {
+        str += 4;
+    }
+    int i;
+    for (i = 0; key_names[i].name != NULL; i++) {
+        if (strcasecmp(str, key_names[i].name) == 0) {
+            *code = key_names[i].code;
+            return 0;
+        }
+    }
+    char * end;
+    const long value = strtol(str, &end, 0);
+    if (*str == '\0' || *end != '\0' || value < 0 || value > KEY_MAX) {
+        return -1;
+    }
+    *code = value;
+    return 0;
+}
+
+int pfc_uinput(const char * keymap_str, int interval_ms, int sim)
+{
+    uint16_t keymap[PIFACECAD_NUM_SWITCHES];
+    const uint16_t * keys = NULL; // library default
+    if (keymap_str != NULL) {
+        char copy[256];
+        snprintf(copy, sizeof(copy), "%s", keymap_str);
+        memset(keymap, 0, sizeof(keymap));
+        int num = 0;
+        char * save;
+        char * tok = strtok_r(copy, ",", &save);
+        for (; tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+            if (num >= PIFACECAD_NUM_SWITCHES) {
+                fprintf(stderr, "pifacecad: more than %d keys in keymap.\n",
+                        PIFACECAD_NUM_SWITCHES);
+                return 1;
+            }
+            if (parse_key(tok, &keymap[num]) < 0) {
+                fprintf(stderr, "pifacecad: no such key '%s'.\n", tok);
+                return 1;
+            }
+            num++;
+        }
+        keys = keymap;
+    }
+
+    pifacecad_open();
+    const unsigned int rate_hz = 1000 / (interval_ms > 0 ? interval_ms : 1);
+    if (pifacecad_uinput_start(NULL, keys, rate_hz) < 0) {
+        perror("pifacecad: could not create uinput device");
+        return 1;
+    }
+
+    catch_quit();
+
+    const struct timespec tick = {0, 100000000L}; // 100ms
+    int grace = 10; // let the last simulated edge through
+    while (!quit_requested && !(sim && pifacecad_sim_done() && --grace <= 0)) {
+        nanosleep(&tick, NULL);
+    }
+    pifacecad_uinput_stop();
+    return 0;
+}
+
+/**********************************************************************/
+/* watch: one line per switch edge, for shell scripts to read */
+
+/* prints the edges from switches old to new, at most max of them, and
+ * returns how many */
+static unsigned long watch_print(uint8_t old,
+                                 uint8_t new,
+                                 int json,
+                                 unsigned long max)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned long num = 0;
+    int i;
+    for (i = 0; i < PIFACECAD_NUM_SWITCHES && num < max; i++) {
+        if (!((old ^ new) & (1 << i))) {
+            continue;
+        }
+        // switches are active low
+        const char * edge = new & (1 << i) ? "released" : "pressed";
+        if (json) {
+            printf("{\"time\": %ld.%06ld, \"switch\": %d, "
+                   "\"edge\": \"%s\"}\n",
+                   (long) now.tv_sec, now.tv_nsec / 1000, i, edge);
+        } else {
+            printf("%ld.%06ld %d %s\n",
+                   (long) now.tv_sec, now.tv_nsec / 1000, i, edge);
+        }
+        num++;
+    }
+    fflush(stdout); // for whatever is reading the pipe
+    return num;
+}
+
+/* Prints switch edges until interrupted or count (0 for no limit) have
+ * been printed. Sleeps on the interrupt line if there is one, else polls
+ * every millisecond just after a change, backing off to interval_ms while
+ * nothing happens. */
+void pfc_watch(unsigned long count, int json, int interval_ms, int sim)
+{
+    const unsigned long max = count > 0 ? count : (unsigned long) -1;
+    int use_interrupts = pifacecad_enable_interrupts() == 0;
+    int poll_ms = 1;
+    uint8_t last = pifacecad_read_switches();
+    unsigned long num = 0;
+
+    catch_quit();
+    while (!quit_requested && num < max) {
+        uint8_t captured = last;
+        if (use_interrupts) {
+            // wake up now and then to notice signals
+            if (pifacecad_wait_for_switches(&captured, 100) < 0 && \
+                    errno != EINTR) {
+                fprintf(stderr, "pifacecad: lost the interrupt line, "
+                                "polling instead.\n");
+                use_interrupts = 0;
+            }
+        } else {
+            const struct timespec tick = {0, poll_ms * 1000000L};
+            nanosleep(&tick, NULL);
+        }
+        const int done = sim && pifacecad_sim_done(); // after this read
+        const uint8_t switches = pifacecad_read_switches();
+
+        // a quick press and release only shows up in the capture
+        num += watch_print(last, captured, json, max - num);
+        num += watch_print(captured, switches, json, max - num);
+        poll_ms = switches != last ? 1 : poll_ms * 2;
+        poll_ms = poll_ms < interval_ms ? poll_ms : interval_ms;
+        poll_ms = poll_ms > 0 ? poll_ms : 1;
+        last = switches;
+        if (done) {
+            break;
+        }
+    }
+    if (use_interrupts) {
+        pifacecad_disable_interrupts();
+    }
+}